@@ -1,132 +1,939 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <new>
 #include <sstream>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
-#define DEBUG_GC 1
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace gclang {
 
 class Object;
 class Expression;
 class StackPointer;
+class RootSet;
+class SymbolObject;
 
-using Symbol = std::string*;
+using Symbol = SymbolObject*;
 using P = Object*;
 using E = std::shared_ptr<Expression>;
 
-extern StackPointer nil;
-extern StackPointer metaint;
+extern P nil;
+extern P metaint;
 
+// Holds its symbols weakly: entries for symbols nothing else references
+// are dropped during markAndSweep, and the symbols collected.
 std::map<std::string, Symbol> internTable;
-std::vector<P> allManagedObjects;
+long objectCount = 0;
 long threshold = 1000;
 
+// Roots live in a side table rather than in object headers: every live
+// StackPointer owns one slot of 'roots', and the marker scans this table.
+std::vector<P> roots;
+std::vector<std::size_t> freeRoots;
+// Host containers of managed objects (gc::vector, gc::map) register here as
+// one root each, however many objects they hold.
+std::unordered_set<const RootSet*> rootSets;
+
+// Small object heap: chunks by base address, pages with free cells by
+// size class, and pages with no live cells, resident or released, by the
+// kind of chunk they belong to. Size class 0 is the large object space,
+// 1-255 are small and the rest medium (see cellSizeOf).
+constexpr std::size_t GRANULE = 8;
+constexpr std::size_t SMALL_SIZE_CLASSES = 256;
+constexpr std::size_t SIZE_CLASSES = SMALL_SIZE_CLASSES + 21;
+enum PageKind { SMALL_PAGES, MEDIUM_PAGES, PAGE_KINDS };
+struct Page;
+struct Chunk;
+std::map<char*, Chunk*> chunks;
+std::vector<Page*> partialPages[SIZE_CLASSES];
+std::vector<Page*> emptyPages[PAGE_KINDS];
+std::vector<Page*> releasedPages[PAGE_KINDS];
+std::size_t retainedBytes = 0;
+std::size_t releasedBytes = 0;
+
+// Empty pages stay resident this long before the scavenger releases them.
+std::chrono::milliseconds scavengeDecay(1000);
+bool scavengeWithMadvFree = false;
+
+// Memory pressure, as last sampled from the cgroup and PSI by
+// checkMemoryPressure. Under MODERATE pressure collections are paced
+// tighter and empty pages released at once; entering CRITICAL forces a
+// collection, and staying there forces another every criticalCooldown.
+enum class Pressure { NONE, MODERATE, CRITICAL };
+Pressure memoryPressure = Pressure::NONE;
+long pressureCheckInterval = 4096;  // allocations between samples
+long allocationsSincePressureCheck = 0;
+std::chrono::milliseconds pressurePeriod(100);  // at most one sample per
+std::chrono::steady_clock::time_point lastPressureCheck;
+std::chrono::milliseconds criticalCooldown(5000);
+std::chrono::steady_clock::time_point lastForcedCollection;
+double moderateUsage = 0.8, criticalUsage = 0.95;  // of memory.max
+double moderateStall = 10, criticalStall = 10;     // PSI some/full avg10, %
+
+// Treat any word on the native stack that points into a heap object as a
+// root (see scanNativeStack), so that host code can hold raw P.
+bool conservativeStackScanning = false;
+std::vector<P> nativeStackRoots;  // what markRoots found there
+
+// The marker's stack never grows past markStackCapacity entries. A marked
+// object that doesn't fit gets its page flagged for a rescan instead, and
+// Arrays are scanned ARRAY_MARK_CHUNK elements at a time, so the memory a
+// collection needs doesn't depend on the shape of the heap.
+struct MarkEntry {
+  P object;
+  std::uint32_t begin;  // next element to scan, for Arrays
+};
+std::vector<MarkEntry> markStack;
+std::size_t markStackCapacity = 4096;
+constexpr std::uint32_t ARRAY_MARK_CHUNK = 256;
+
+// Debugging aids, off by default and chosen at run time (see main): with
+// gcStressInterval set, a full collection runs every that many allocations
+// rather than when the threshold is crossed, and with verifyCollections the
+// heap is checked by verifyHeap before and after every collection. Either
+// one sets checkRoots, which aborts when a StackPointer releases a root slot
+// it doesn't own, rather than letting the collector free a live object.
+long gcStressInterval = 0;
+long allocationsSinceStress = 0;
+bool verifyCollections = false;
+bool checkRoots = false;
+
+// Whether allocations, deaths, root changes, heap stores and regions are
+// being recorded to a trace file (see startTrace).
+bool tracing = false;
+
+// Heap limits in bytes, 0 for none (see enforceHeapLimits).
+std::size_t heapSoftLimit = 0;
+std::size_t heapHardLimit = 0;
+std::size_t softLimitRearm = 0;
+
+// Heap placement: optionally ask for transparent huge pages on chunks, and,
+// when heapNumaNode is set, bind chunks and large objects to that NUMA node.
+// Huge pages are off by default: they fight the scavenger, which releases
+// memory 16K at a time (see scavenge).
+bool useHugePages = false;
+int heapNumaNode = -1;
+
+// Large object space: start of each mapping -> its size, and whether it
+// holds an object rather than a backing store.
+struct LargeMapping {
+  std::size_t size;
+  bool object;
+  bool marked;
+  bool rescan;
+  std::uint32_t refcount;
+  std::uint64_t traceId;  // see TraceRecorder
+};
+std::map<void*, LargeMapping> largeMappings;
+std::size_t largeObjectBytes = 0;
+std::size_t bufferBytes = 0;  // malloc'd by allocateBuffer
+
+// The permanent space holds builtins created at startup, and whatever the
+// heap held when it was frozen (see freezeHeap). Its objects are never
+// swept and never marked; only the ones that have been given a reference to
+// a heap object are traced, as extra roots, on each collection.
+std::vector<P> permanentMutables;
+
+// Dead objects waiting for their C++ destructors to run (see runFinalizers).
+std::vector<P> finalizationQueue;
+std::size_t finalizerBatch = 64;
+
+// Script-level finalizers: once 'target' is collected, 'callback' is called
+// with 'held'. Both of those are kept alive by the registration; the target
+// is held weakly.
+struct Finalizer {
+  P target, callback, held;
+};
+std::vector<Finalizer> finalizers;
+std::vector<Finalizer> pendingFinalizers;
+
+// Optional deferred reference counting (see setRefCounting). Heap stores are
+// logged by writeBarrier and the log is applied in batches; objects whose
+// count reaches zero wait in the zero count table until a batch finds them
+// unrooted, and objects whose count drops without reaching zero are
+// candidates for the cycle collector.
+bool refCounting = false;
+std::vector<P> refIncrements;
+std::vector<P> refDecrements;
+std::vector<P> zeroCountTable;
+std::unordered_set<P> cycleCandidates;
+long reconcileInterval = 1000;
+long allocationsSinceReconcile = 0;
+std::size_t cycleCandidateLimit = 10000;
+
+// Request-scoped region (see beginRegion): the pages small objects are bump
+// allocated from while it is active, the current page of each size class,
+// the objects that need their destructors run when it ends, the region
+// objects that something outside the region has been given, and the root
+// slots taken for region objects. Pages a region dropped are kept, still
+// formatted, for the next region's allocations of their size class, and
+// the site tables of the pages it adopted for the next pages it formats,
+// until the scavenger takes them back (see scavenge).
+bool regionActive = false;
+std::vector<Page*> regionPages;
+Page *regionCurrent[SIZE_CLASSES];
+std::vector<P> regionFinalizable;
+std::vector<P> regionRemembered;
+std::vector<std::size_t> regionRoots;
+std::vector<Page*> regionSparePages[SIZE_CLASSES];
+std::vector<void*> regionMixedCells;  // allocated on Page::mixed pages
+std::vector<std::vector<std::uint32_t>> regionSpareSites;
+
+// Allocation statistics of one Expression node: objects allocated while it
+// is the innermost node being evaluated are attributed to it. Survival is
+// measured against regions, the one place objects are expected to die
+// young: a site whose region objects mostly escape is pretenured, and its
+// objects go straight into the heap.
+struct AllocationSite {
+  long allocated = 0;        // everything allocated here
+  long regionAllocated = 0;  // of that, in a region
+  long survived = 0;         // of those, escaped their region
+  bool pretenure = false;
+  bool inRegion = false;     // on regionSites
+  bool released = false;     // its node is gone; freed when the region ends
+  std::uint64_t traceId = 0;  // see TraceRecorder
+};
+// Sites live in this table rather than in their nodes, and are referred to
+// by index, 0 being none: region pages record the site of every object, and
+// a script can be compiled, run and dropped before its region ends.
+std::vector<AllocationSite> allocationSites(1);
+std::vector<std::uint32_t> freeSites;
+std::uint32_t currentSite = 0;
+std::vector<std::uint32_t> regionSites;  // sites allocated at this region
+long pretenureMinSamples = 100;
+double pretenureSurvival = 0.5;
+long pretenureSampling = 16;  // a pretenured site still samples 1 in this
+
+std::uint32_t newSite() {
+  if (freeSites.empty()) {
+    allocationSites.emplace_back();
+    return static_cast<std::uint32_t>(allocationSites.size() - 1);
+  }
+  std::uint32_t id = freeSites.back();
+  freeSites.pop_back();
+  return id;
+}
+
+// Frees a site whose node is gone, unless objects of the active region
+// still refer to it; endRegion frees it then.
+void releaseSite(std::uint32_t id) {
+  AllocationSite &site = allocationSites[id];
+  if (site.inRegion) {
+    site.released = true;
+    return;
+  }
+  site = AllocationSite();
+  freeSites.push_back(id);
+}
+
 Symbol intern(const std::string&);
-void markAndSweep();
+void markAndSweep(bool triggered = false);
+bool deferFinalization(P);
+void sweepPages();
+void sweepLargeObjects();
+void scavenge(bool all);
+void recountReferences();
+std::uint32_t &refcountOf(P);
+void enterZeroCountTable(P);
+void decrementRef(P);
+void applyRefUpdates();
+std::size_t verifyHeap(const char*);
+void traceAllocation(P, std::size_t);
+void traceDeath(P);
+void traceRoot(P, bool);
+void traceRoots(P);
+void traceCollection();
+void traceEdge(P, P, P);
+void tracePut(P, P, P);
+void traceRegion(bool);
+void holdWeakly(P);
+bool isMarked(P);
+void setMarked(P, bool);
+bool markObject(P);
+void scanNativeStack(std::vector<P>&);
+void markForRescan(P);
+void rescanOverflowed(const std::function<void(P)>&);
+void forEachRegionObject(const std::function<void(P)>&);
+P objectAt(std::uintptr_t);
+void destroy(P);
+void *allocateBuffer(std::size_t);
+void freeBuffer(void*, std::size_t);
+void *growBuffer(void*, std::size_t, std::size_t);
 
 template <class T, class ...Args> T *make(Args &&...args);
+template <class T, class ...Args> T *makeSized(std::size_t, Args &&...args);
+template <class T, class ...Args> T *makePermanent(Args &&...args);
+
+// Builtin symbols are interned at compile time: each one has a fixed id in
+// sym::Id and is a pinned SymbolObject in builtinSymbols, which intern()
+// consults before touching the intern table.
+#define BUILTIN_SYMBOLS(X) \
+  X(add) X(sub) X(mul) X(div) X(eq) X(lt) \
+  X(deref) X(get) X(put)
+
+namespace sym {
+#define X(name) name,
+enum Id: unsigned { BUILTIN_SYMBOLS(X) count };
+#undef X
+}  // namespace sym
+
+constexpr unsigned NO_SYMBOL = ~0u;
+
+Symbol builtin(sym::Id id);
+unsigned symbolId(Symbol s);
+
+// Methods of builtin classes are dispatched through a MethodTable rather
+// than through their metatable. The table is a perfect hash on builtin
+// symbol ids (slot = id % size) computed at compile time by MethodTableOf,
+// so a lookup is one indexed load and one compare.
+using BuiltinFn = P(*)(P, const std::vector<StackPointer>&);
 
+struct BuiltinMethod {
+  unsigned id;
+  BuiltinFn fn;
+};
+
+struct MethodTable {
+  unsigned size;
+  const BuiltinMethod *slots;
+  BuiltinFn find(Symbol s) const {
+    unsigned id = symbolId(s);
+    const BuiltinMethod &m = slots[id % size];
+    return m.id == id ? m.fn : nullptr;
+  }
+};
+
+enum class Type: std::uint8_t {
+  NIL, SYMBOL, NUMBER, STRING, ARRAY, TABLE, FUNCTION,
+  RECORD_TYPE, RECORD, RECORD_COLUMNS,
+  WEAK_REF, EPHEMERON_TABLE,
+  TRACE_PROXY,
+};
+
+// Per-type behaviour, indexed by Object::type. It stands in for a vtable so
+// that objects don't have to carry a vptr.
+struct TypeInfo {
+  const char *name;
+  void (*destruct)(P);
+  void (*traverse)(P, const std::function<void(P)>&);
+  P (*meta)(P);
+  bool (*truthy)(P);
+  bool (*equals)(P, P);
+  std::string (*debugstr)(const Object*);
+  P (*call)(P, P, const std::vector<StackPointer>&);
+  const MethodTable &(*methods)(P);
+  P (*get)(P, Symbol);
+  void (*declare)(P, Symbol, P);
+  void (*set)(P, Symbol, P);
+  bool trivial;  // destruct does nothing, so freeing can't be deferred
+};
+
+extern const TypeInfo typeInfos[];
+
+// Every managed object starts with this 8 byte header. Its members forward
+// to the object's TypeInfo. Mark state is not in here but in side tables
+// (see isMarked), so a collection never writes to a live object.
 class Object {
 public:
-  enum class Color { BLACK, WHITE };
-  Color color = Color::WHITE;
-  long refcnt = 0;
-
-  Object()=default;
-  virtual ~Object() {}
-  virtual void traverse(std::function<void(P)>)=0;
-  virtual P meta() { throw "Not implemented"; }
-  virtual bool truthy() { return true; }
-  virtual bool equals(P p) { return this == p; }
-  virtual std::string debugstr() const {
-    std::stringstream ss;
-    ss << typeid(*this).name() << "@" << this;
-    return ss.str();
+  enum Flags: std::uint8_t {
+    PERMANENT = 1,
+    FINALIZING = 2,
+    WEAKLY_HELD = 4,  // seen by a weak reference; only markAndSweep frees it
+    IN_ZCT = 8,       // on zeroCountTable
+    REGION = 16,      // in the active region, and not known to escape it
+    REMEMBERED = 32,  // permanent, and on permanentMutables
+  };
+  const Type type;
+  std::uint8_t flags = 0;
+  std::uint16_t sizeClass = 0;
+  std::uint32_t length = 0;  // element count of variable-sized objects
+
+  explicit Object(Type t): type(t) {}
+  const TypeInfo &info() const { return typeInfos[static_cast<int>(type)]; }
+  const char *typeName() const { return info().name; }
+  void traverse(const std::function<void(P)> &f) { info().traverse(this, f); }
+  P meta() { return info().meta(this); }
+  bool truthy() { return info().truthy(this); }
+  bool equals(P p) { return info().equals(this, p); }
+  std::string debugstr() const { return info().debugstr(this); }
+  P call(P owner, const std::vector<StackPointer> &args) {
+    return info().call(this, owner, args);
   }
-  virtual P call(P, const std::vector<StackPointer>&) { throw "Not implemented"; }
+  const MethodTable &methods() { return info().methods(this); }
   P callm(Symbol methodName, const std::vector<StackPointer> &args) {
+    if (BuiltinFn f = methods().find(methodName)) {
+      return f(this, args);
+    }
     return meta()->get(methodName)->call(this, args);
   }
-  virtual P get(Symbol) { throw "Not implemented"; }
-  virtual void declare(Symbol, P) { throw "Not implemented"; }
-  virtual void set(Symbol, P) { throw "Not implemented"; }
+  P get(Symbol s) { return info().get(this, s); }
+  void declare(Symbol s, P v) { info().declare(this, s, v); }
+  void set(Symbol s, P v) { info().set(this, s, v); }
 };
 
+static_assert(sizeof(Object) == 8, "object header must stay 8 bytes");
+
+template <class T>
+T *cast(P p) {
+  return p && p->type == T::TYPE ? static_cast<T*>(p) : nullptr;
+}
+
+// A StackPointer owns one slot in 'roots' for as long as it is non-null:
+// copies take a new slot, moves transfer the existing one and leave the
+// source empty, so passing handles around by value costs nothing extra.
 class StackPointer final {
 private:
-  const P p;
+  static constexpr std::size_t NO_SLOT = ~std::size_t(0);
+  P p;
+  std::size_t slot;
+  void retain() {
+    if (p && tracing) {
+      traceRoot(p, true);
+    }
+    if (!p) {
+      slot = NO_SLOT;
+    } else if (freeRoots.empty()) {
+      slot = roots.size();
+      roots.push_back(p);
+    } else {
+      slot = freeRoots.back();
+      freeRoots.pop_back();
+      roots[slot] = p;
+    }
+    if (p && regionActive && (p->flags & Object::REGION)) {
+      regionRoots.push_back(slot);
+    }
+  }
+  void release() {
+    if (p) {
+      if (checkRoots && (slot >= roots.size() || roots[slot] != p)) {
+        std::cerr << "bad root release of " << p->debugstr() << std::endl;
+        std::abort();
+      }
+      roots[slot] = nullptr;
+      freeRoots.push_back(slot);
+      if (tracing) {
+        traceRoot(p, false);
+      }
+    }
+  }
 public:
-  StackPointer(P ptr): p(ptr) { p->refcnt++; }
-  ~StackPointer() { p->refcnt--; }
+  StackPointer(P ptr): p(ptr) { retain(); }
+  StackPointer(const StackPointer &s): p(s.p) { retain(); }
+  StackPointer(StackPointer &&s) noexcept: p(s.p), slot(s.slot) {
+    s.p = nullptr;
+    s.slot = NO_SLOT;
+  }
+  StackPointer &operator=(StackPointer s) noexcept {
+    std::swap(p, s.p);
+    std::swap(slot, s.slot);
+    return *this;
+  }
+  ~StackPointer() { release(); }
   P get() const { return p; }
   P operator->() const { return get(); }
   operator P() const { return get(); }
 };
 
-class Nil final: public Object {
-  void traverse(std::function<void(P)>) override {}
-  bool truthy() override { return false; }
-  std::string debugstr() const override { return "nil"; }
+// A RootSet is registered with the collector for as long as it exists, and
+// each collection has it visit the objects it holds. Copies register on
+// their own. Regions don't scan root sets when they end, so a RootSet has
+// to report the region objects it is given as they come in (see
+// gc::remember).
+class RootSet {
+public:
+  RootSet() { rootSets.insert(this); }
+  RootSet(const RootSet&): RootSet() {}
+  RootSet &operator=(const RootSet&) { return *this; }
+  virtual ~RootSet() { rootSets.erase(this); }
+  virtual void traceRoots(const std::function<void(P)> &visit) const = 0;
+};
+
+// Calls visit on every object the roots and root sets hold.
+void forEachRoot(const std::function<void(P)> &visit) {
+  for (P p: roots) {
+    if (p) {
+      visit(p);
+    }
+  }
+  for (const RootSet *set: rootSets) {
+    set->traceRoots(visit);
+  }
+}
+
+// Containers for host code holding many managed objects, registered as a
+// single RootSet, so elements cost no root slot each. They wrap the standard
+// ones rather than derive from them, so that every element goes in through
+// them: elements are read through const access only, and replaced through
+// members like set.
+namespace gc {
+
+// A region object put into a host container has escaped its region.
+template <class T>
+void remember(T value, std::true_type) {
+  P p = value;
+  if (p && (p->flags & Object::REGION)) {
+    regionRemembered.push_back(p);
+  }
+}
+
+template <class T>
+void remember(const T&, std::false_type) {}
+
+template <class T>
+void remember(const T &value) {
+  remember(value, std::is_convertible<T, P>());
+}
+
+template <class T>
+void traceValue(const std::function<void(P)> &visit, T value, std::true_type) {
+  if (value) {
+    visit(value);
+  }
+}
+
+template <class T>
+void traceValue(const std::function<void(P)>&, const T&, std::false_type) {}
+
+template <class T>
+void traceValue(const std::function<void(P)> &visit, const T &value) {
+  traceValue(visit, value, std::is_convertible<T, P>());
+}
+
+template <class T>
+class vector final: private RootSet {
+  static_assert(std::is_convertible<T, P>::value, "gc::vector holds objects");
+public:
+  using value_type = T;
+  using const_iterator = typename std::vector<T>::const_iterator;
+  vector() = default;
+  vector(std::initializer_list<T> values) { assign(values.begin(), values.end()); }
+  template <class It>
+  vector(It first, It last) { assign(first, last); }
+  const_iterator begin() const { return items.begin(); }
+  const_iterator end() const { return items.end(); }
+  std::size_t size() const { return items.size(); }
+  bool empty() const { return items.empty(); }
+  T operator[](std::size_t i) const { return items[i]; }
+  T back() const { return items.back(); }
+  void set(std::size_t i, T value) {
+    remember(value);
+    items.at(i) = value;
+  }
+  void push_back(T value) {
+    remember(value);
+    items.push_back(value);
+  }
+  void pop_back() { items.pop_back(); }
+  template <class It>
+  void assign(It first, It last) {
+    items.assign(first, last);
+    for (const T &value: items) {
+      remember(value);
+    }
+  }
+  const_iterator erase(const_iterator pos) { return items.erase(pos); }
+  void clear() { items.clear(); }
+  void reserve(std::size_t n) { items.reserve(n); }
+  void traceRoots(const std::function<void(P)> &visit) const override {
+    for (const T &value: items) {
+      traceValue(visit, value);
+    }
+  }
+private:
+  std::vector<T> items;
+};
+
+// Keys are traced too when they are objects.
+template <class K, class V, class Compare = std::less<K>>
+class map final: private RootSet {
+  static_assert(std::is_convertible<V, P>::value, "gc::map holds objects");
+public:
+  using value_type = typename std::map<K, V, Compare>::value_type;
+  using const_iterator = typename std::map<K, V, Compare>::const_iterator;
+  const_iterator begin() const { return items.begin(); }
+  const_iterator end() const { return items.end(); }
+  std::size_t size() const { return items.size(); }
+  bool empty() const { return items.empty(); }
+  const_iterator find(const K &key) const { return items.find(key); }
+  std::size_t count(const K &key) const { return items.count(key); }
+  V at(const K &key) const { return items.at(key); }
+  // Maps 'key' to 'value', replacing any value it had.
+  void set(const K &key, V value) {
+    remember(key);
+    remember(value);
+    auto entry = items.emplace(key, value);
+    if (!entry.second) {
+      entry.first->second = value;
+    }
+  }
+  std::size_t erase(const K &key) { return items.erase(key); }
+  const_iterator erase(const_iterator pos) { return items.erase(pos); }
+  void clear() { items.clear(); }
+  void traceRoots(const std::function<void(P)> &visit) const override {
+    for (const auto &entry: items) {
+      traceValue(visit, entry.first);
+      traceValue(visit, entry.second);
+    }
+  }
+private:
+  std::map<K, V, Compare> items;
+};
+
+}  // namespace gc
+
+// A permanent object that is given a reference to a heap object has to be
+// traced by every collection from then on; references to other permanent
+// objects don't count.
+void rememberMutation(P holder, P to) {
+  auto flags = holder->flags & (Object::PERMANENT | Object::REMEMBERED);
+  if (flags == Object::PERMANENT && to && !(to->flags & Object::PERMANENT)) {
+    holder->flags |= Object::REMEMBERED;
+    permanentMutables.push_back(holder);
+  }
+}
+
+// Every store of a reference into a heap object goes through here: 'holder'
+// had 'from' in some slot and now has 'to' there. A region object stored
+// into an object outside the region has escaped it. With reference counting
+// on, the update is logged, and gets applied by the next reconcileRefCounts.
+void writeBarrier(P holder, P from, P to) {
+  if (tracing && from != to) {
+    traceEdge(holder, from, to);
+  }
+  rememberMutation(holder, to);
+  if (regionActive && to && (to->flags & Object::REGION) &&
+      !(holder->flags & Object::REGION)) {
+    regionRemembered.push_back(to);
+  }
+  if (refCounting && from != to) {
+    if (to) {
+      refIncrements.push_back(to);
+    }
+    if (from) {
+      refDecrements.push_back(from);
+    }
+  }
+}
+
+template <unsigned Id, BuiltinFn Fn>
+struct Method {
+  static constexpr unsigned id = Id;
+  static constexpr BuiltinFn fn = Fn;
+};
+
+constexpr bool collides(unsigned, unsigned) { return false; }
+template <class ...Ids>
+constexpr bool collides(unsigned size, unsigned id, unsigned first, Ids ...rest) {
+  return id % size == first % size || collides(size, id, rest...);
+}
+
+constexpr bool distinctSlots(unsigned) { return true; }
+template <class ...Ids>
+constexpr bool distinctSlots(unsigned size, unsigned first, Ids ...rest) {
+  return !collides(size, first, rest...) && distinctSlots(size, rest...);
+}
+
+// Smallest table size >= 'size' for which 'id % size' is collision free.
+template <class ...Ids>
+constexpr unsigned perfectSize(unsigned size, Ids ...ids) {
+  return distinctSlots(size, ids...) ? size : perfectSize(size + 1, ids...);
+}
+
+constexpr BuiltinMethod pickMethod(unsigned, unsigned) {
+  return BuiltinMethod{NO_SYMBOL, nullptr};
+}
+template <class ...Methods>
+constexpr BuiltinMethod pickMethod(
+    unsigned size, unsigned slot, BuiltinMethod m, Methods ...rest) {
+  return m.id % size == slot ? m : pickMethod(size, slot, rest...);
+}
+
+template <unsigned ...> struct Indices {};
+template <unsigned N, unsigned ...Is>
+struct MakeIndices: MakeIndices<N - 1, N - 1, Is...> {};
+template <unsigned ...Is>
+struct MakeIndices<0, Is...> { using type = Indices<Is...>; };
+
+template <unsigned Size, class Slots, class ...Methods> struct MethodSlots;
+template <unsigned Size, unsigned ...Is, class ...Methods>
+struct MethodSlots<Size, Indices<Is...>, Methods...> {
+  static constexpr BuiltinMethod slots[Size] = {
+    pickMethod(Size, Is, BuiltinMethod{Methods::id, Methods::fn}...)...
+  };
+};
+template <unsigned Size, unsigned ...Is, class ...Methods>
+constexpr BuiltinMethod MethodSlots<Size, Indices<Is...>, Methods...>::slots[Size];
+
+// MethodTableOf<Method<sym::add, f>, ...>::table is the dispatch table for a
+// builtin class, laid out entirely at compile time.
+template <class ...Methods>
+struct MethodTableOf {
+  static constexpr unsigned size = perfectSize(
+      sizeof...(Methods) ? sizeof...(Methods) : 1, Methods::id...);
+  using Slots = MethodSlots<size, typename MakeIndices<size>::type, Methods...>;
+  static constexpr MethodTable table{size, Slots::slots};
+};
+template <class ...Methods>
+constexpr MethodTable MethodTableOf<Methods...>::table;
+
+// Default behaviour for the Object interface. Concrete types derive from
+// Managed<their type> and hide whichever members they implement;
+// typeInfoOf<T> then picks up the most derived one.
+template <Type Tag>
+class Managed: public Object {
+public:
+  static constexpr Type TYPE = Tag;
+  Managed(): Object(Tag) {}
+  void traverse(const std::function<void(P)>&) {}
+  P meta() { throw "Not implemented"; }
+  bool truthy() { return true; }
+  bool equals(P p) { return this == p; }
+  std::string debugstr() const {
+    std::stringstream ss;
+    ss << typeName() << "@" << this;
+    return ss.str();
+  }
+  P call(P, const std::vector<StackPointer>&) { throw "Not implemented"; }
+  const MethodTable &methods() { return MethodTableOf<>::table; }
+  P get(Symbol) { throw "Not implemented"; }
+  void declare(Symbol, P) { throw "Not implemented"; }
+  void set(Symbol, P) { throw "Not implemented"; }
+};
+
+class Nil final: public Managed<Type::NIL> {
+public:
+  bool truthy() { return false; }
+  std::string debugstr() const { return "nil"; }
+};
+
+class SymbolObject final: public Managed<Type::SYMBOL> {
+public:
+  const std::string name;
+  SymbolObject(const std::string &n): name(n) {
+    flags |= WEAKLY_HELD;  // by the intern table
+  }
+  // Builtin symbols are pinned: they live outside the heap, like the
+  // permanent space, and are never collected.
+  SymbolObject(const char *n, bool pinned): name(n) {
+    if (pinned) {
+      flags |= PERMANENT;
+    }
+  }
+  std::string debugstr() const { return name; }
+};
+
+SymbolObject builtinSymbols[] = {
+#define X(name) SymbolObject(#name, true),
+  BUILTIN_SYMBOLS(X)
+#undef X
 };
 
-class Number final: public Object {
+Symbol builtin(sym::Id id) { return &builtinSymbols[id]; }
+
+unsigned symbolId(Symbol s) {
+  auto offset = reinterpret_cast<std::uintptr_t>(s) -
+                reinterpret_cast<std::uintptr_t>(builtinSymbols);
+  auto id = offset / sizeof(SymbolObject);
+  return id < sym::count ? static_cast<unsigned>(id) : NO_SYMBOL;
+}
+
+class Number final: public Managed<Type::NUMBER> {
 public:
   const double value;
   Number(double v): value(v) {}
-  bool truthy() override { return value != 0; }
-  void traverse(std::function<void(P)>) override {}
-  bool equals(P p) override {
+  bool truthy() { return value != 0; }
+  bool equals(P p) {
     if (this == p) { return true; }
-    auto q = dynamic_cast<Number*>(p);
+    auto q = cast<Number>(p);
     return q && value == q->value;
   }
-  P meta() override { return metaint; }
-  std::string debugstr() const override {
+  P meta() { return metaint; }
+  const MethodTable &methods();
+  std::string debugstr() const {
     std::stringstream ss;
     ss << "num(" << value << ")";
     return ss.str();
   }
 };
 
+static_assert(sizeof(Number) == 16, "Number should be header + double");
+
 P mkn(double d) { return make<Number>(d); }
 
-class String final: public Object {
+double numarg(const std::vector<StackPointer> &args) {
+  if (args.size() != 1) {
+    throw "Expected 1 argument";
+  }
+  auto n = cast<Number>(args[0].get());
+  if (!n) {
+    throw "Expected a number";
+  }
+  return n->value;
+}
+
+double numself(P self) { return static_cast<Number*>(self)->value; }
+
+P numberAdd(P self, const std::vector<StackPointer> &args) {
+  return mkn(numself(self) + numarg(args));
+}
+
+P numberSub(P self, const std::vector<StackPointer> &args) {
+  return mkn(numself(self) - numarg(args));
+}
+
+P numberMul(P self, const std::vector<StackPointer> &args) {
+  return mkn(numself(self) * numarg(args));
+}
+
+P numberDiv(P self, const std::vector<StackPointer> &args) {
+  return mkn(numself(self) / numarg(args));
+}
+
+P numberEq(P self, const std::vector<StackPointer> &args) {
+  return mkn(numself(self) == numarg(args));
+}
+
+P numberLt(P self, const std::vector<StackPointer> &args) {
+  return mkn(numself(self) < numarg(args));
+}
+
+const MethodTable &Number::methods() {
+  return MethodTableOf<
+      Method<sym::add, numberAdd>,
+      Method<sym::sub, numberSub>,
+      Method<sym::mul, numberMul>,
+      Method<sym::div, numberDiv>,
+      Method<sym::eq, numberEq>,
+      Method<sym::lt, numberLt>>::table;
+}
+
+std::uint32_t checkLength(std::size_t n) {
+  if (n > UINT32_MAX) {
+    throw "Too many elements";
+  }
+  return static_cast<std::uint32_t>(n);
+}
+
+// The characters of a String sit directly after its header; 'length' is
+// the number of them. Only mks knows how much room to allocate.
+class String final: public Managed<Type::STRING> {
 public:
-  const std::string buffer;
-  String(const std::string &s): buffer(s) {}
-  void traverse(std::function<void(P)>) override {}
-  bool truthy() override { return !buffer.empty(); }
-  bool equals(P p) override {
+  String(const std::string &s) {
+    length = checkLength(s.size());
+    std::memcpy(data(), s.data(), s.size());
+  }
+  char *data() { return reinterpret_cast<char*>(this + 1); }
+  const char *data() const { return reinterpret_cast<const char*>(this + 1); }
+  std::string str() const { return std::string(data(), length); }
+  bool truthy() { return length != 0; }
+  bool equals(P p) {
     if (this == p) { return true; }
-    auto q = dynamic_cast<String*>(p);
-    return q && buffer == q->buffer;
+    auto q = cast<String>(p);
+    return q && length == q->length &&
+           std::memcmp(data(), q->data(), length) == 0;
   }
 };
 
-P mks(const std::string &s) { return make<String>(s); }
+P mks(const std::string &s) {
+  return makeSized<String>(sizeof(String) + s.size(), s);
+}
+
+// Standard containers inside heap objects keep their storage in buffers
+// too, so that it counts toward the heap limits.
+template <class T>
+struct BufferAllocator {
+  using value_type = T;
+  BufferAllocator() = default;
+  template <class U> BufferAllocator(const BufferAllocator<U>&) {}
+  T *allocate(std::size_t n) {
+    return static_cast<T*>(allocateBuffer(n * sizeof(T)));
+  }
+  void deallocate(T *p, std::size_t n) { freeBuffer(p, n * sizeof(T)); }
+};
 
-class Array final: public Object {
+template <class T, class U>
+bool operator==(const BufferAllocator<T>&, const BufferAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const BufferAllocator<T>&, const BufferAllocator<U>&) { return false; }
+
+template <class K, class V>
+using BufferMap = std::map<K, V, std::less<K>, BufferAllocator<std::pair<const K, V>>>;
+template <class T>
+using BufferVector = std::vector<T, BufferAllocator<T>>;
+
+// An Array's initial elements sit directly after it, and 'elements' points
+// at them until a push outgrows that space; from then on the elements live
+// in a separately allocated backing store.
+class Array final: public Managed<Type::ARRAY> {
 public:
-  std::vector<P> buffer;
-  Array(const std::vector<P> &v): buffer(v) {}
-  void traverse(std::function<void(P)> f) override {
-    for (P p: buffer) {
-      f(p);
+  P *elements;
+  std::size_t capacity;
+  Array(const std::vector<P> &v):
+      elements(reinterpret_cast<P*>(this + 1)), capacity(v.size()) {
+    length = checkLength(v.size());
+    std::copy(v.begin(), v.end(), elements);
+  }
+  ~Array() {
+    if (spilled()) {
+      freeBuffer(elements, capacity * sizeof(P));
+    }
+  }
+  bool spilled() const { return elements != reinterpret_cast<const P*>(this + 1); }
+  std::size_t size() const { return length; }
+  P at(std::size_t i) const { return elements[i]; }
+  void push(P p) {
+    if (length == capacity) {
+      std::size_t newCapacity = capacity < 4 ? 4 : capacity * 2;
+      P *store;
+      if (spilled()) {
+        store = static_cast<P*>(growBuffer(elements, capacity * sizeof(P),
+                                           newCapacity * sizeof(P)));
+      } else {
+        store = static_cast<P*>(allocateBuffer(newCapacity * sizeof(P)));
+        std::copy(elements, elements + length, store);
+      }
+      elements = store;
+      capacity = newCapacity;
+    }
+    elements[length] = p;
+    length = checkLength(length + 1);
+    writeBarrier(this, nullptr, p);
+  }
+  void traverse(const std::function<void(P)> &f) {
+    for (std::size_t i = 0; i < length; i++) {
+      f(elements[i]);
     }
   }
-  bool equals(P p) override {
+  bool equals(P p) {
     if (this == p) { return true; }
-    auto q = dynamic_cast<Array*>(p);
-    if (buffer.size() != q->buffer.size()) {
+    auto q = cast<Array>(p);
+    if (!q || length != q->length) {
       return false;
     }
-    for (unsigned long i = 0; i < buffer.size(); i++) {
-      if (!buffer[i]->equals(q->buffer[i])) {
+    for (std::size_t i = 0; i < length; i++) {
+      if (!elements[i]->equals(q->elements[i])) {
         return false;
       }
     }
@@ -134,21 +941,26 @@ public:
   }
 };
 
-class Table final: public Object {
+P mkarr(const std::vector<P> &v) {
+  return makeSized<Array>(sizeof(Array) + v.size() * sizeof(P), v);
+}
+
+class Table final: public Managed<Type::TABLE> {
 public:
   Table *const proto;
-  std::map<Symbol, P> buffer;
+  BufferMap<Symbol, P> buffer;
   Table(Table *p): proto(p) {}
-  Table(Table *p, const std::map<Symbol, P> &b): proto(p), buffer(b) {}
-  void traverse(std::function<void(P)> f) override {
+  Table(Table *p, const BufferMap<Symbol, P> &b): proto(p), buffer(b) {}
+  void traverse(const std::function<void(P)> &f) {
     if (proto) {
       f(proto);
     }
     for (auto iter = buffer.begin(); iter != buffer.end(); ++iter) {
+      f(iter->first);
       f(iter->second);
     }
   }
-  P get(Symbol s) override {
+  P get(Symbol s) {
     auto iter = buffer.find(s);
     if (iter != buffer.end()) {
       return iter->second;
@@ -156,172 +968,3602 @@ public:
     if (proto) {
       return proto->get(s);
     }
-    throw "No such symbol: " + *s;
+    throw "No such symbol: " + s->name;
   }
-  void declare(Symbol s, P v) override {
-    if (buffer.find(s) != buffer.end()) {
+  // Both mutators probe each map exactly once: 'declare' inserts into this
+  // table only, 'set' updates the nearest table in the proto chain that
+  // already holds the key.
+  void declare(Symbol s, P v) {
+    if (!buffer.emplace(s, v).second) {
       throw "Already declared";
     }
-    buffer[s] = v;
+    writeBarrier(this, nullptr, s);
+    writeBarrier(this, nullptr, v);
   }
-  void set(Symbol s, P v) override {
-    if (buffer.find(s) == buffer.end()) {
-      buffer[s] = v;
-    } else if (proto) {
-      proto->set(s, v);
-    } else {
-      throw "No such key: " + *s;
+  void set(Symbol s, P v) {
+    for (Table *t = this; t; t = t->proto) {
+      auto iter = t->buffer.find(s);
+      if (iter != t->buffer.end()) {
+        writeBarrier(t, iter->second, v);
+        iter->second = v;
+        return;
+      }
     }
+    throw "No such key: " + s->name;
+  }
+  // Removes 's' from this table only; returns whether it was there.
+  bool remove(Symbol s) {
+    auto iter = buffer.find(s);
+    if (iter == buffer.end()) {
+      return false;
+    }
+    writeBarrier(this, iter->first, nullptr);
+    writeBarrier(this, iter->second, nullptr);
+    buffer.erase(iter);
+    return true;
   }
 };
 
-class Function final: public Object {
+class Function final: public Managed<Type::FUNCTION> {
 public:
   P(*const fptr)(P, const std::vector<StackPointer>&);
   Function(P(*f)(P, const std::vector<StackPointer>&)): fptr(f) {}
-  void traverse(std::function<void(P)>) override {}
-  P call(P owner, const std::vector<StackPointer> &args) override {
+  P call(P owner, const std::vector<StackPointer> &args) {
     return fptr(owner, args);
   }
 };
 
-P mkfunc(P(*f)(P, const std::vector<StackPointer>&)) {
-  return make<Function>(f);
-}
-
-class Expression: public std::enable_shared_from_this<Expression> {
-public:
-  virtual P eval(P env)=0;
-};
-
-class Literal: public Expression {
-public:
-  StackPointer value;
-  Literal(P v): value(v) {}
-  P eval(P) override { return value.get(); }
-};
-
-E mklit(P v) { return std::make_shared<Literal>(v); }
-
-class If: public Expression {
+// A RecordType fixes the layout of its records when it is defined: field i
+// lives in slot i of every Record. NUMBER fields are stored unboxed. Field
+// names are unique, since fields are looked up by name.
+class RecordType final: public Managed<Type::RECORD_TYPE> {
 public:
-  E condition, body, other;
-  If(E c, E b, E t): condition(c), body(b), other(t) {}
-  P eval(P env) override {
-    if (condition->eval(env)->truthy())
-      return body->eval(env);
-    else
-      return other->eval(env);
+  enum class Kind { VALUE, NUMBER };
+  struct Field {
+    Symbol name;
+    Kind kind;
+  };
+  static constexpr std::size_t NO_FIELD = ~std::size_t(0);
+  const std::vector<Field> fields;
+  RecordType(const std::vector<Field> &f): fields(f) {
+    for (std::size_t i = 0; i < fields.size(); i++) {
+      if (slotOf(fields[i].name) != i) {
+        throw "Duplicate field: " + fields[i].name->name;
+      }
+    }
   }
-};
-
-E mkif(E c, E b, E t) { return std::make_shared<If>(c, b, t); }
-
-class Block: public Expression {
-public:
-  std::vector<E> statements;
-  Block(std::vector<E> stmts): statements(stmts) {}
-  P eval(P env) {
-    if (statements.empty()) {
-      return nil;
-    } else {
-      for (unsigned int i = 0; i < statements.size(); i++) {
-        statements[i]->eval(env);
+  void traverse(const std::function<void(P)> &f) {
+    for (const Field &field: fields) {
+      f(field.name);
+    }
+  }
+  std::size_t slotOf(Symbol s) const {
+    for (std::size_t i = 0; i < fields.size(); i++) {
+      if (fields[i].name == s) {
+        return i;
       }
-      return statements.back()->eval(env);
     }
+    return NO_FIELD;
+  }
+  std::size_t checkedSlotOf(Symbol s) const {
+    std::size_t slot = slotOf(s);
+    if (slot == NO_FIELD) {
+      throw "No such field: " + s->name;
+    }
+    return slot;
   }
 };
 
-// variable definitions
-StackPointer nil(make<Nil>());
-StackPointer metaint(make<Table>(nullptr));
-
-// function definitions
-E mkblock(std::vector<E> stmts) { return std::make_shared<Block>(stmts); }
+union Slot {
+  P value;
+  double number;
+};
 
-Symbol intern(const std::string &s) {
-  auto iter = internTable.find(s);
-  if (iter != internTable.end()) {
-    return iter->second;
+Slot toSlot(RecordType::Kind kind, P v) {
+  Slot slot;
+  if (kind == RecordType::Kind::VALUE) {
+    slot.value = v;
   } else {
-    auto sym = new std::string(s);
-    internTable[s] = sym;
-    return sym;
+    auto n = cast<Number>(v);
+    if (!n) {
+      throw "Expected a number";
+    }
+    slot.number = n->value;
   }
+  return slot;
 }
 
-void markAndSweep() {
-  long workDone = 0;
-  // mark
-  std::vector<P> greyStack;
-  for (P p: allManagedObjects) {
-    workDone++;
-    if (p->refcnt > 0 && p->color == Object::Color::WHITE) {
-      p->color = Object::Color::BLACK;
-      greyStack.push_back(p);
+P fromSlot(RecordType::Kind kind, Slot slot);
+
+// A Record is its header, its type and one inline Slot per field.
+class Record final: public Managed<Type::RECORD> {
+public:
+  RecordType *const recordType;
+  Record(RecordType *t): recordType(t) {
+    length = checkLength(t->fields.size());
+    for (std::size_t i = 0; i < length; i++) {
+      if (t->fields[i].kind == RecordType::Kind::VALUE) {
+        slots()[i].value = nil;
+      } else {
+        slots()[i].number = 0;
+      }
     }
   }
-  while (!greyStack.empty()) {
-    P p = greyStack.back();
-    greyStack.pop_back();
-    p->traverse([&](P q) {
-      workDone++;
-      if (q->color == Object::Color::WHITE) {
-        q->color = Object::Color::BLACK;
-        greyStack.push_back(q);
+  Slot *slots() { return reinterpret_cast<Slot*>(this + 1); }
+  void traverse(const std::function<void(P)> &f) {
+    f(recordType);
+    for (std::size_t i = 0; i < length; i++) {
+      if (recordType->fields[i].kind == RecordType::Kind::VALUE) {
+        f(slots()[i].value);
       }
-    });
+    }
   }
-  // sweep
-  std::vector<P> survivors;
-  for (P p: allManagedObjects) {
-    if (p->color == Object::Color::WHITE) {
-      delete p;
-    } else {
-      p->color = Object::Color::WHITE;
-      survivors.push_back(p);
+  P get(Symbol s) { return load(recordType->checkedSlotOf(s)); }
+  void set(Symbol s, P v) { store(recordType->checkedSlotOf(s), v); }
+  // By slot, for callers that looked the field up once (see slotOf).
+  P load(std::size_t slot) {
+    checkSlot(slot);
+    return fromSlot(recordType->fields[slot].kind, slots()[slot]);
+  }
+  void store(std::size_t slot, P v) {
+    checkSlot(slot);
+    Slot s = toSlot(recordType->fields[slot].kind, v);
+    if (recordType->fields[slot].kind == RecordType::Kind::VALUE) {
+      writeBarrier(this, slots()[slot].value, v);
     }
+    slots()[slot] = s;
   }
-  threshold = workDone * 3 + 1000;
-
-  allManagedObjects = std::move(survivors);
+  void checkSlot(std::size_t slot) const {
+    if (slot >= length) {
+      throw "No such field slot";
+    }
+  }
+};
+
+// Struct-of-arrays storage for many records of one RecordType: one column
+// per field, so NUMBER columns are plain arrays of doubles the collector
+// never has to look at.
+class RecordColumns final: public Managed<Type::RECORD_COLUMNS> {
+public:
+  RecordType *const recordType;
+  BufferVector<BufferVector<Slot>> columns;
+  RecordColumns(RecordType *t): recordType(t), columns(t->fields.size()) {}
+  std::size_t size() const { return columns.empty() ? 0 : columns[0].size(); }
+  void push(Record *r) {
+    if (r->recordType != recordType) {
+      throw "Record type mismatch";
+    }
+    for (std::size_t i = 0; i < columns.size(); i++) {
+      columns[i].push_back(r->slots()[i]);
+      if (recordType->fields[i].kind == RecordType::Kind::VALUE) {
+        writeBarrier(this, nullptr, r->slots()[i].value);
+      }
+    }
+  }
+  P load(std::size_t row, std::size_t slot) {
+    checkIndex(row, slot);
+    return fromSlot(recordType->fields[slot].kind, columns[slot][row]);
+  }
+  void store(std::size_t row, std::size_t slot, P v) {
+    checkIndex(row, slot);
+    Slot s = toSlot(recordType->fields[slot].kind, v);
+    if (recordType->fields[slot].kind == RecordType::Kind::VALUE) {
+      writeBarrier(this, columns[slot][row].value, v);
+    }
+    columns[slot][row] = s;
+  }
+  void checkIndex(std::size_t row, std::size_t slot) const {
+    if (slot >= columns.size()) {
+      throw "No such field slot";
+    }
+    if (row >= size()) {
+      throw "Row out of range";
+    }
+  }
+  void traverse(const std::function<void(P)> &f) {
+    f(recordType);
+    for (std::size_t i = 0; i < columns.size(); i++) {
+      if (recordType->fields[i].kind == RecordType::Kind::VALUE) {
+        for (const Slot &slot: columns[i]) {
+          f(slot.value);
+        }
+      }
+    }
+  }
+};
+
+// Weak objects are not traversed like the others: the marker discovers them
+// as it goes and deals with their contents after ordinary marking is done.
+
+// A WeakRef doesn't keep its target alive; once the target is collected
+// the WeakRef reads as nil.
+class WeakRef final: public Managed<Type::WEAK_REF> {
+public:
+  P target;
+  WeakRef(P t): target(t) {}
+  const MethodTable &methods();
+};
+
+// An ephemeron table maps objects (by identity) to values. An entry keeps
+// its value alive only while its key is reachable from elsewhere, and is
+// dropped once the key is collected, which makes it a memoization cache
+// that doesn't pin its keys.
+class EphemeronTable final: public Managed<Type::EPHEMERON_TABLE> {
+public:
+  BufferMap<P, P> entries;
+  const MethodTable &methods();
+  void put(P key, P value) {
+    if (tracing) {
+      tracePut(this, key, value);
+    }
+    holdWeakly(key);
+    holdWeakly(value);
+    rememberMutation(this, key);
+    rememberMutation(this, value);
+    entries[key] = value;
+  }
+};
+
+// What a trace replay (see replayTrace) allocates in place of each recorded
+// object other than an ephemeron table: a cell of the recorded size, which
+// holds as many of the references it is given as fit after the proxy. The
+// rest, such as a Table's entries, spill into proxyReferences, which stands
+// in for the malloc'd storage of the original. That way a proxy needs no
+// destructor; see pruneProxyReferences for how their storage is freed.
+std::unordered_map<const Object*, std::vector<P>> proxyReferences;
+
+class TraceProxy final: public Managed<Type::TRACE_PROXY> {
+public:
+  std::uint32_t capacity;  // references that fit in the cell; 'length' held
+  bool spilled = false;    // holds more in proxyReferences
+  TraceProxy(std::size_t size):
+      capacity(checkLength((size - sizeof(TraceProxy)) / sizeof(P))) {}
+  P *slots() { return reinterpret_cast<P*>(this + 1); }
+  // Replaces 'from' with 'to': a null 'from' adds 'to', and a null 'to'
+  // removes 'from', whose place the last reference takes. Returns false if
+  // 'from' isn't held.
+  bool replace(P from, P to) {
+    if (!from) {
+      if (length < capacity) {
+        slots()[length++] = to;
+      } else {
+        if (!spilled) {
+          proxyReferences[this].clear();
+          spilled = true;
+        }
+        proxyReferences[this].push_back(to);
+      }
+      return true;
+    }
+    std::vector<P> *more = spilled ? &proxyReferences[this] : nullptr;
+    P *slot = std::find(slots(), slots() + length, from);
+    if (slot == slots() + length) {
+      auto iter = more ? std::find(more->begin(), more->end(), from)
+                       : std::vector<P>::iterator();
+      if (!more || iter == more->end()) {
+        return false;
+      }
+      slot = &*iter;
+    }
+    if (to) {
+      *slot = to;
+    } else if (more && !more->empty()) {
+      *slot = more->back();
+      more->pop_back();
+    } else {
+      *slot = slots()[--length];
+    }
+    return true;
+  }
+  void traverse(const std::function<void(P)> &f) {
+    for (std::uint32_t i = 0; i < length; i++) {
+      f(slots()[i]);
+    }
+    if (spilled) {
+      for (P p: proxyReferences[this]) {
+        f(p);
+      }
+    }
+  }
+};
+
+// Frees the spilled references of proxies that have died since the last
+// call, as their destructors would have.
+void pruneProxyReferences() {
+  for (auto iter = proxyReferences.begin(); iter != proxyReferences.end();) {
+    auto p = const_cast<P>(iter->first);
+    auto proxy = objectAt(reinterpret_cast<std::uintptr_t>(p)) == p
+        ? cast<TraceProxy>(p) : nullptr;
+    if (proxy && proxy->spilled) {
+      ++iter;
+    } else {
+      iter = proxyReferences.erase(iter);
+    }
+  }
+}
+
+static_assert(std::is_trivially_destructible<TraceProxy>::value,
+              "trace proxies must be freed without finalization");
+
+template <class T>
+struct Dispatch {
+  static T *self(P p) { return static_cast<T*>(p); }
+  static void destruct(P p) { self(p)->~T(); }
+  static void traverse(P p, const std::function<void(P)> &f) {
+    self(p)->traverse(f);
+  }
+  static P meta(P p) { return self(p)->meta(); }
+  static bool truthy(P p) { return self(p)->truthy(); }
+  static bool equals(P p, P q) { return self(p)->equals(q); }
+  static std::string debugstr(const Object *p) {
+    return static_cast<const T*>(p)->debugstr();
+  }
+  static P call(P p, P owner, const std::vector<StackPointer> &args) {
+    return self(p)->call(owner, args);
+  }
+  static const MethodTable &methods(P p) { return self(p)->methods(); }
+  static P get(P p, Symbol s) { return self(p)->get(s); }
+  static void declare(P p, Symbol s, P v) { self(p)->declare(s, v); }
+  static void set(P p, Symbol s, P v) { self(p)->set(s, v); }
+};
+
+template <class T>
+constexpr TypeInfo typeInfoOf(const char *name) {
+  return TypeInfo{
+    name,
+    Dispatch<T>::destruct,
+    Dispatch<T>::traverse,
+    Dispatch<T>::meta,
+    Dispatch<T>::truthy,
+    Dispatch<T>::equals,
+    Dispatch<T>::debugstr,
+    Dispatch<T>::call,
+    Dispatch<T>::methods,
+    Dispatch<T>::get,
+    Dispatch<T>::declare,
+    Dispatch<T>::set,
+    std::is_trivially_destructible<T>::value,
+  };
+}
+
+// In Type order.
+const TypeInfo typeInfos[] = {
+  typeInfoOf<Nil>("Nil"),
+  typeInfoOf<SymbolObject>("Symbol"),
+  typeInfoOf<Number>("Number"),
+  typeInfoOf<String>("String"),
+  typeInfoOf<Array>("Array"),
+  typeInfoOf<Table>("Table"),
+  typeInfoOf<Function>("Function"),
+  typeInfoOf<RecordType>("RecordType"),
+  typeInfoOf<Record>("Record"),
+  typeInfoOf<RecordColumns>("RecordColumns"),
+  typeInfoOf<WeakRef>("WeakRef"),
+  typeInfoOf<EphemeronTable>("EphemeronTable"),
+  typeInfoOf<TraceProxy>("TraceProxy"),
+};
+
+P fromSlot(RecordType::Kind kind, Slot slot) {
+  return kind == RecordType::Kind::VALUE ? slot.value : mkn(slot.number);
+}
+
+P mkrecordtype(const std::vector<RecordType::Field> &fields) {
+  return make<RecordType>(fields);
+}
+
+P mkrecord(RecordType *t) {
+  return makeSized<Record>(sizeof(Record) + t->fields.size() * sizeof(Slot), t);
+}
+
+P mkcolumns(RecordType *t) { return make<RecordColumns>(t); }
+
+P mkweak(P target) {
+  holdWeakly(target);
+  return make<WeakRef>(target);
+}
+
+P mkephemerons() { return make<EphemeronTable>(); }
+
+P weakDeref(P self, const std::vector<StackPointer> &args) {
+  if (!args.empty()) {
+    throw "Expected 0 arguments";
+  }
+  return static_cast<WeakRef*>(self)->target;
+}
+
+const MethodTable &WeakRef::methods() {
+  return MethodTableOf<Method<sym::deref, weakDeref>>::table;
+}
+
+P ephemeronGet(P self, const std::vector<StackPointer> &args) {
+  if (args.size() != 1) {
+    throw "Expected 1 argument";
+  }
+  auto &entries = static_cast<EphemeronTable*>(self)->entries;
+  auto iter = entries.find(args[0]);
+  return iter == entries.end() ? nil : iter->second;
+}
+
+P ephemeronPut(P self, const std::vector<StackPointer> &args) {
+  if (args.size() != 2) {
+    throw "Expected 2 arguments";
+  }
+  static_cast<EphemeronTable*>(self)->put(args[0], args[1]);
+  return args[1];
+}
+
+const MethodTable &EphemeronTable::methods() {
+  return MethodTableOf<
+      Method<sym::get, ephemeronGet>,
+      Method<sym::put, ephemeronPut>>::table;
+}
+
+P mkfunc(P(*f)(P, const std::vector<StackPointer>&)) {
+  return make<Function>(f);
+}
+
+class Expression: public std::enable_shared_from_this<Expression> {
+public:
+  const std::uint32_t site = newSite();
+  Expression() = default;
+  Expression(const Expression&) = delete;
+  Expression &operator=(const Expression&) = delete;
+  virtual ~Expression() { releaseSite(site); }
+  // Evaluates the node, with it as the current allocation site.
+  P eval(P env) {
+    struct Restore {
+      std::uint32_t outer;
+      ~Restore() { currentSite = outer; }
+    } restore{currentSite};
+    currentSite = site;
+    return evaluate(env);
+  }
+  virtual P evaluate(P env)=0;
+};
+
+// The constants of one compilation unit. They are kept in a single Array,
+// which is the unit's only root however many literals it has, and equal
+// numbers and strings share one constant.
+class ConstantPool {
+public:
+  ConstantPool(): constants(mkarr({})) {}
+  std::size_t size() const { return array()->size(); }
+  // Returns the pooled constant equal to 'v', adding 'v' if there is none.
+  // 'v' is indexed only once it's in the pool, since the push can throw.
+  P add(P v) {
+    if (v->flags & Object::PERMANENT) {
+      return v;
+    }
+    std::size_t index = size();
+    if (auto n = cast<Number>(v)) {
+      std::uint64_t bits;
+      std::memcpy(&bits, &n->value, sizeof(bits));
+      auto iter = numbers.find(bits);
+      if (iter != numbers.end()) {
+        return array()->at(iter->second);
+      }
+      array()->push(v);
+      numbers.emplace(bits, index);
+    } else if (auto s = cast<String>(v)) {
+      auto iter = strings.find(s->str());
+      if (iter != strings.end()) {
+        return array()->at(iter->second);
+      }
+      array()->push(v);
+      strings.emplace(s->str(), index);
+    } else {
+      array()->push(v);
+    }
+    return v;
+  }
+private:
+  StackPointer constants;
+  std::map<std::uint64_t, std::size_t> numbers;  // by bit pattern
+  std::map<std::string, std::size_t> strings;
+  Array *array() const { return static_cast<Array*>(constants.get()); }
+};
+
+class Literal: public Expression {
+public:
+  const std::shared_ptr<ConstantPool> pool;
+  const P value;  // kept alive by the pool
+  Literal(const std::shared_ptr<ConstantPool> &p, P v): pool(p), value(v) {}
+  P evaluate(P) override { return value; }
+};
+
+E mklit(const std::shared_ptr<ConstantPool> &pool, P v) {
+  return std::make_shared<Literal>(pool, pool->add(v));
+}
+
+// A literal outside any compilation unit gets a pool of its own.
+E mklit(P v) {
+  StackPointer value(v);
+  return mklit(std::make_shared<ConstantPool>(), value);
+}
+
+class If: public Expression {
+public:
+  E condition, body, other;
+  If(E c, E b, E t): condition(c), body(b), other(t) {}
+  P evaluate(P env) override {
+    if (condition->eval(env)->truthy())
+      return body->eval(env);
+    else
+      return other->eval(env);
+  }
+};
+
+E mkif(E c, E b, E t) { return std::make_shared<If>(c, b, t); }
+
+// Evaluates 'body', or, if that fails with a script error (running out of
+// memory included), 'handler'.
+class Try: public Expression {
+public:
+  E body, handler;
+  Try(E b, E h): body(b), handler(h) {}
+  P evaluate(P env) override {
+    try {
+      return body->eval(env);
+    } catch (const char*) {
+    } catch (const std::string&) {
+    }
+    return handler->eval(env);
+  }
+};
+
+E mktry(E b, E h) { return std::make_shared<Try>(b, h); }
+
+class Block: public Expression {
+public:
+  std::vector<E> statements;
+  Block(std::vector<E> stmts): statements(stmts) {}
+  P evaluate(P env) override {
+    if (statements.empty()) {
+      return nil;
+    } else {
+      for (unsigned int i = 0; i < statements.size(); i++) {
+        statements[i]->eval(env);
+      }
+      return statements.back()->eval(env);
+    }
+  }
+};
+
+// variable definitions
+P nil = makePermanent<Nil>();
+P metaint = makePermanent<Table>(nullptr);
+
+// function definitions
+E mkblock(std::vector<E> stmts) { return std::make_shared<Block>(stmts); }
+
+Symbol intern(const std::string &s) {
+  for (auto &b: builtinSymbols) {
+    if (b.name == s) {
+      return &b;
+    }
+  }
+  auto iter = internTable.find(s);
+  if (iter != internTable.end()) {
+    return iter->second;
+  } else {
+    auto sym = make<SymbolObject>(s);
+    internTable[s] = sym;
+    return sym;
+  }
+}
+
+// 'triggered' is for collections the collector starts itself, which a
+// trace replay leaves to the replaying process; the host's are replayed.
+void markAndSweep(bool triggered) {
+  if (verifyCollections && verifyHeap("before collection")) {
+    std::abort();
+  }
+  if (tracing) {
+    traceRoots(nullptr);
+    if (!triggered) {
+      traceCollection();
+    }
+  }
+  long workDone = 0;
+  // mark
+  std::vector<WeakRef*> weakRefs;
+  std::vector<EphemeronTable*> ephemeronTables;
+  bool overflowed = false;
+  markStack.reserve(markStackCapacity);
+  auto push = [&](P p) {
+    if (markStack.size() < markStackCapacity) {
+      markStack.push_back(MarkEntry{p, 0});
+    } else {
+      overflowed = true;
+      markForRescan(p);
+    }
+  };
+  // Weak objects are set aside as soon as they are marked; their contents
+  // are dealt with once marking is done.
+  std::function<void(P)> mark = [&](P q) {
+    workDone++;
+    if (markObject(q)) {
+      if (auto w = cast<WeakRef>(q)) {
+        weakRefs.push_back(w);
+      } else if (auto t = cast<EphemeronTable>(q)) {
+        ephemeronTables.push_back(t);
+      } else {
+        push(q);
+      }
+    }
+  };
+  auto drainStack = [&]() {
+    while (!markStack.empty()) {
+      MarkEntry entry = markStack.back();
+      markStack.pop_back();
+      auto a = cast<Array>(entry.object);
+      if (!a) {
+        entry.object->traverse(mark);
+        continue;
+      }
+      std::uint32_t end = a->length - entry.begin > ARRAY_MARK_CHUNK
+          ? entry.begin + ARRAY_MARK_CHUNK : a->length;
+      if (end < a->length) {
+        markStack.push_back(MarkEntry{a, end});
+      }
+      for (std::uint32_t i = entry.begin; i < end; i++) {
+        mark(a->at(i));
+      }
+    }
+  };
+  auto drain = [&]() {
+    drainStack();
+    while (overflowed) {
+      overflowed = false;
+      rescanOverflowed([&](P p) {
+        if (!cast<WeakRef>(p) && !cast<EphemeronTable>(p)) {
+          push(p);
+          drainStack();
+        }
+      });
+    }
+  };
+  for (P p: roots) {
+    if (p) {
+      mark(p);
+    } else {
+      workDone++;
+    }
+  }
+  for (const RootSet *set: rootSets) {
+    set->traceRoots(mark);
+  }
+  if (conservativeStackScanning) {
+    std::vector<P> found;
+    scanNativeStack(found);
+    for (P p: found) {
+      mark(p);
+    }
+  }
+  for (P p: permanentMutables) {
+    if (auto t = cast<EphemeronTable>(p)) {
+      ephemeronTables.push_back(t);
+    } else {
+      p->traverse(mark);
+    }
+  }
+  for (auto list: {&finalizers, &pendingFinalizers}) {
+    for (Finalizer &f: *list) {
+      mark(f.callback);
+      mark(f.held);
+    }
+  }
+  // Region objects outlive the collection whether or not they are reached:
+  // the remembered ones are promoted when the region ends, and a stale word
+  // on the native stack can still find the others. So they are roots, and
+  // what they point to stays live.
+  if (regionActive) {
+    forEachRegionObject(mark);
+  }
+  drain();
+  // ephemerons: marking a value can make more keys reachable, so repeat
+  // until a pass over every discovered table marks nothing new
+  for (bool progress = true; progress;) {
+    progress = false;
+    for (std::size_t i = 0; i < ephemeronTables.size(); i++) {
+      for (auto &entry: ephemeronTables[i]->entries) {
+        workDone++;
+        if (isMarked(entry.first) && !isMarked(entry.second)) {
+          mark(entry.second);
+          progress = true;
+        }
+      }
+      drain();
+    }
+  }
+  // clear weak references to anything left unmarked, and queue the
+  // finalizers of dead targets
+  for (auto iter = finalizers.begin(); iter != finalizers.end();) {
+    if (isMarked(iter->target)) {
+      ++iter;
+    } else {
+      pendingFinalizers.push_back(*iter);
+      iter = finalizers.erase(iter);
+    }
+  }
+  for (EphemeronTable *t: ephemeronTables) {
+    for (auto iter = t->entries.begin(); iter != t->entries.end();) {
+      iter = isMarked(iter->first) ? std::next(iter) : t->entries.erase(iter);
+    }
+  }
+  for (WeakRef *w: weakRefs) {
+    if (!isMarked(w->target)) {
+      w->target = nil;
+    }
+  }
+  for (auto iter = internTable.begin(); iter != internTable.end();) {
+    iter = isMarked(iter->second) ? std::next(iter) : internTable.erase(iter);
+  }
+  // sweep
+  sweepPages();
+  sweepLargeObjects();
+  threshold = workDone * (memoryPressure == Pressure::NONE ? 3 : 1) + 1000;
+  if (refCounting) {
+    recountReferences();
+  }
+  scavenge(memoryPressure != Pressure::NONE);
+  if (verifyCollections && verifyHeap("after collection")) {
+    std::abort();
+  }
+}
+// Small size classes are multiples of GRANULE. Medium ones start at 2K and
+// grow by a quarter of a power of two at a time, four steps to a doubling,
+// up to LARGE_OBJECT_SIZE; anything bigger goes to the large object space.
+constexpr std::size_t MAX_CELL_SIZE = (SMALL_SIZE_CLASSES - 1) * GRANULE;
+constexpr std::size_t LARGE_OBJECT_SIZE = 64 * 1024;
+
+constexpr std::size_t cellSizeOf(std::uint16_t sizeClass) {
+  return sizeClass < SMALL_SIZE_CLASSES
+      ? sizeClass * GRANULE
+      : (std::size_t(2048) << (sizeClass - SMALL_SIZE_CLASSES) / 4) *
+        (4 + (sizeClass - SMALL_SIZE_CLASSES) % 4) / 4;
+}
+static_assert(cellSizeOf(SIZE_CLASSES - 1) == LARGE_OBJECT_SIZE,
+              "the last medium size class must reach LARGE_OBJECT_SIZE");
+
+std::uint16_t sizeClassOf(std::size_t size) {
+  if (size <= MAX_CELL_SIZE) {
+    return static_cast<std::uint16_t>((size + GRANULE - 1) / GRANULE);
+  }
+  std::uint16_t sizeClass = SMALL_SIZE_CLASSES;
+  while (cellSizeOf(sizeClass) < size) {
+    sizeClass++;
+  }
+  return sizeClass;
+}
+
+PageKind pageKindOf(std::uint16_t sizeClass) {
+  return sizeClass < SMALL_SIZE_CLASSES ? SMALL_PAGES : MEDIUM_PAGES;
+}
+
+std::size_t pageSize() {
+  static const std::size_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+void *mapMemory(std::size_t size) {
+  void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+// Small object heap. Cells of one size class share a HEAP_PAGE_SIZE page,
+// or a MEDIUM_PAGE_SIZE one for medium size classes; pages are carved out
+// of CHUNK_SIZE-aligned chunks mapped from the OS, each chunk holding pages
+// of one size, and their bookkeeping lives in the Chunk, out of line, so
+// that an empty page's memory can be handed back to the OS without losing
+// track of it.
+constexpr std::size_t HEAP_PAGE_SIZE = 16 * 1024;
+constexpr std::size_t MEDIUM_PAGE_SIZE = 256 * 1024;
+constexpr std::size_t CHUNK_SIZE = 2 * 1024 * 1024;
+constexpr std::size_t PAGES_PER_CHUNK = CHUNK_SIZE / HEAP_PAGE_SIZE;
+constexpr std::size_t MAX_CELLS = HEAP_PAGE_SIZE / GRANULE;
+static_assert(MEDIUM_PAGE_SIZE / cellSizeOf(SMALL_SIZE_CLASSES) <= MAX_CELLS,
+              "medium pages must not hold more cells than small ones");
+
+struct Page {
+  enum class State: std::uint8_t { IN_USE, EMPTY, RELEASED, FROZEN };
+  char *start = nullptr;
+  std::uint32_t size = 0;  // HEAP_PAGE_SIZE or MEDIUM_PAGE_SIZE, by kind
+  PageKind kind = SMALL_PAGES;
+  State state = State::RELEASED;
+  std::uint16_t sizeClass = 0;
+  bool partial = false;  // on partialPages[sizeClass]
+  bool rescan = false;   // holds marked objects the mark stack overflowed on
+  bool region = false;   // owned by the active region
+  bool mixed = false;    // a region page that holds heap objects too
+  std::uint32_t cellSize = 0, cellCount = 0, liveCount = 0;
+  std::uint64_t cellReciprocal = 0;  // ceil(2^40 / cellSize), see indexOf
+  std::uint32_t bump = 0;  // cells from here on have never been handed out
+  void *freeList = nullptr;
+  std::chrono::steady_clock::time_point emptySince;
+  std::uint64_t allocated[MAX_CELLS / 64];
+  std::uint64_t marked[MAX_CELLS / 64];
+  std::vector<std::uint32_t> refcounts;  // per cell, with refCounting on
+  std::vector<std::uint32_t> sites;      // per cell, on region pages
+  std::vector<std::uint64_t> traceIds;   // per cell, while tracing
+
+  void format(std::uint16_t sc) {
+    state = State::IN_USE;
+    region = false;
+    sizeClass = sc;
+    cellSize = static_cast<std::uint32_t>(cellSizeOf(sc));
+    cellCount = size / cellSize;
+    cellReciprocal = (std::uint64_t(1) << 40) / cellSize + 1;
+    liveCount = bump = 0;
+    freeList = nullptr;
+    std::fill(std::begin(allocated), std::end(allocated), 0);
+    std::fill(std::begin(marked), std::end(marked), 0);
+    refcounts.assign(refCounting ? cellCount : 0, 0);
+    traceIds.assign(tracing ? cellCount : 0, 0);
+  }
+  char *cell(std::uint32_t i) { return start + i * cellSize; }
+  // Offsets within a page are small enough that multiplying by the
+  // reciprocal gives the exact quotient, without a division on every mark.
+  std::uint32_t indexOf(const void *cell) const {
+    std::uint64_t offset = static_cast<const char*>(cell) - start;
+    return static_cast<std::uint32_t>(offset * cellReciprocal >> 40);
+  }
+  bool isAllocated(std::uint32_t i) const {
+    return allocated[i / 64] >> (i % 64) & 1;
+  }
+  bool isMarked(std::uint32_t i) const {
+    return marked[i / 64] >> (i % 64) & 1;
+  }
+  void setMarked(std::uint32_t i, bool m) {
+    std::uint64_t bit = std::uint64_t(1) << (i % 64);
+    marked[i / 64] = m ? marked[i / 64] | bit : marked[i / 64] & ~bit;
+  }
+  void *allocate() {
+    void *c;
+    if (freeList) {
+      c = freeList;
+      freeList = *static_cast<void**>(c);
+    } else if (bump < cellCount) {
+      c = cell(bump++);
+    } else {
+      return nullptr;
+    }
+    std::uint32_t i = indexOf(c);
+    allocated[i / 64] |= std::uint64_t(1) << (i % 64);
+    liveCount++;
+    return c;
+  }
+  void free(void *c) {
+    std::uint32_t i = indexOf(c);
+    allocated[i / 64] &= ~(std::uint64_t(1) << (i % 64));
+    *static_cast<void**>(c) = freeList;
+    freeList = c;
+    liveCount--;
+  }
+  // Empties the page for reuse in the same size class, which only needs the
+  // bitmap words its cells ever reached cleared.
+  void reset() {
+    std::size_t words = (bump + 63) / 64;
+    std::fill(allocated, allocated + words, 0);
+    std::fill(marked, marked + words, 0);
+    state = State::IN_USE;
+    liveCount = bump = 0;
+    freeList = nullptr;
+    if (refcounts.size() != (refCounting ? cellCount : 0)) {
+      refcounts.assign(refCounting ? cellCount : 0, 0);
+    }
+  }
+};
+
+// A chunk of medium pages only uses the first CHUNK_SIZE / MEDIUM_PAGE_SIZE
+// entries of 'pages'; the others stay RELEASED and on no list.
+struct Chunk {
+  char *base;
+  unsigned pageShift;  // log2 of the chunk's page size
+  Page pages[PAGES_PER_CHUNK];
+};
+
+bool bindToNode(void *p, std::size_t size, int node) {
+  unsigned long nodemask = 1UL << node;
+  return syscall(SYS_mbind, p, size, MPOL_BIND, &nodemask,
+                 sizeof(nodemask) * CHAR_BIT + 1, MPOL_MF_MOVE) == 0;
+}
+
+void placeMemory(void *p, std::size_t size, bool hugePages) {
+#ifdef MADV_HUGEPAGE
+  if (hugePages && useHugePages) {
+    madvise(p, size, MADV_HUGEPAGE);
+  }
+#else
+  (void) hugePages;
+#endif
+  if (heapNumaNode >= 0) {
+    bindToNode(p, size, heapNumaNode);
+  }
+}
+
+void mapChunk(PageKind kind) {
+  // Over-map so the chunk can be aligned to its own size, then trim.
+  char *raw = static_cast<char*>(mapMemory(2 * CHUNK_SIZE));
+  auto misalignment = reinterpret_cast<std::uintptr_t>(raw) % CHUNK_SIZE;
+  char *base = raw + (misalignment ? CHUNK_SIZE - misalignment : 0);
+  if (base != raw) {
+    munmap(raw, base - raw);
+  }
+  munmap(base + CHUNK_SIZE, raw + 2 * CHUNK_SIZE - (base + CHUNK_SIZE));
+  // Since the chunk is aligned to 2M, each chunk can be a single huge page
+  // (until the scavenger releases part of it, which splits it again).
+  placeMemory(base, CHUNK_SIZE, true);
+  std::size_t size = kind == MEDIUM_PAGES ? MEDIUM_PAGE_SIZE : HEAP_PAGE_SIZE;
+  Chunk *chunk = new Chunk();
+  chunk->base = base;
+  chunk->pageShift = __builtin_ctzl(size);
+  for (std::size_t i = CHUNK_SIZE / size; i > 0; i--) {
+    Page &page = chunk->pages[i - 1];
+    page.start = base + (i - 1) * size;
+    page.size = static_cast<std::uint32_t>(size);
+    page.kind = kind;
+    releasedPages[kind].push_back(&page);
+  }
+  chunks[base] = chunk;
+  releasedBytes += CHUNK_SIZE;
+}
+
+// Chunks are never unmapped, so the last one looked up can be cached; the
+// marker, which calls this for every edge, mostly stays within one chunk.
+Chunk *lastChunk = nullptr;
+
+Page *pageOf(const void *cell) {
+  auto address = reinterpret_cast<std::uintptr_t>(cell);
+  char *base = reinterpret_cast<char*>(address - address % CHUNK_SIZE);
+  if (!lastChunk || lastChunk->base != base) {
+    auto iter = chunks.find(base);
+    if (iter == chunks.end()) {
+      return nullptr;
+    }
+    lastChunk = iter->second;
+  }
+  return &lastChunk->pages[(address % CHUNK_SIZE) >> lastChunk->pageShift];
+}
+
+// Mark bits live in side tables, one bit per cell in the object's Page and
+// one per mapping in the large object space. Permanent objects count as
+// marked.
+bool isMarked(P p) {
+  if (p->flags & Object::PERMANENT) {
+    return true;
+  }
+  if (p->sizeClass == 0) {
+    return largeMappings.find(p)->second.marked;
+  }
+  Page *page = pageOf(p);
+  return page->isMarked(page->indexOf(p));
+}
+
+// Sets the mark bit of 'p', returning false if it was already set.
+bool markObject(P p) {
+  if (p->flags & Object::PERMANENT) {
+    return false;
+  }
+  if (p->sizeClass == 0) {
+    bool &marked = largeMappings.find(p)->second.marked;
+    return !marked && (marked = true);
+  }
+  Page *page = pageOf(p);
+  std::uint32_t i = page->indexOf(p);
+  if (page->isMarked(i)) {
+    return false;
+  }
+  page->setMarked(i, true);
+  return true;
+}
+
+void setMarked(P p, bool marked) {
+  if (p->sizeClass == 0) {
+    largeMappings.find(p)->second.marked = marked;
+  } else {
+    Page *page = pageOf(p);
+    page->setMarked(page->indexOf(p), marked);
+  }
+}
+
+// The heap object a word points into, if any: an allocated cell of an
+// in-use page, or a large object. Objects waiting for their destructors
+// are dead whatever points at them.
+P objectAt(std::uintptr_t word) {
+  P p;
+  if (Page *page = pageOf(reinterpret_cast<void*>(word))) {
+    auto offset = word - reinterpret_cast<std::uintptr_t>(page->start);
+    if (page->state != Page::State::IN_USE ||
+        offset >= page->cellCount * page->cellSize) {
+      return nullptr;
+    }
+    std::uint32_t i = page->indexOf(reinterpret_cast<void*>(word));
+    if (!page->isAllocated(i)) {
+      return nullptr;
+    }
+    p = reinterpret_cast<P>(page->cell(i));
+  } else {
+    auto iter = largeMappings.upper_bound(reinterpret_cast<void*>(word));
+    if (iter == largeMappings.begin()) {
+      return nullptr;
+    }
+    --iter;
+    auto start = reinterpret_cast<std::uintptr_t>(iter->first);
+    if (!iter->second.object || word >= start + iter->second.size) {
+      return nullptr;
+    }
+    p = static_cast<P>(iter->first);
+  }
+  return p->flags & Object::FINALIZING ? nullptr : p;
+}
+
+char *nativeStackTop() {
+  pthread_attr_t attr;
+  void *base = nullptr;
+  std::size_t size = 0;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    pthread_attr_getstack(&attr, &base, &size);
+    pthread_attr_destroy(&attr);
+  }
+  return static_cast<char*>(base) + size;
+}
+
+// Collects every heap object that a word on the mutator's stack, from this
+// frame up, points into. The callee-saved registers are spilled into this
+// frame first, so pointers held only in registers are seen too. The reads
+// aren't instrumented: most of the stack belongs to other frames.
+__attribute__((noinline, no_sanitize_address))
+void scanNativeStack(std::vector<P> &found) {
+  __builtin_unwind_init();
+  static char *const top = nativeStackTop();
+  std::uintptr_t here = 0;
+  for (char *w = reinterpret_cast<char*>(&here);
+       w + sizeof(std::uintptr_t) <= top; w += sizeof(std::uintptr_t)) {
+    if (P p = objectAt(*reinterpret_cast<std::uintptr_t*>(w))) {
+      found.push_back(p);
+    }
+  }
+}
+
+void markForRescan(P p) {
+  if (p->sizeClass == 0) {
+    largeMappings.find(p)->second.rescan = true;
+  } else {
+    pageOf(p)->rescan = true;
+  }
+}
+
+// Calls f on every marked object of the pages and large objects flagged by
+// markForRescan, clearing the flags. Objects in there that were scanned
+// already are scanned again, which is harmless: their children are marked.
+void rescanOverflowed(const std::function<void(P)> &f) {
+  for (auto &entry: chunks) {
+    for (Page &page: entry.second->pages) {
+      if (!page.rescan) {
+        continue;
+      }
+      page.rescan = false;
+      for (std::uint32_t i = 0; i < page.bump; i++) {
+        if (page.isAllocated(i) && page.isMarked(i)) {
+          f(reinterpret_cast<P>(page.cell(i)));
+        }
+      }
+    }
+  }
+  for (auto &entry: largeMappings) {
+    if (entry.second.rescan) {
+      entry.second.rescan = false;
+      f(static_cast<P>(entry.first));
+    }
+  }
+}
+
+// Reuses the most recently emptied page of the kind, which is the most
+// likely to still be resident; falls back to released pages, and then to a
+// new chunk.
+Page *takeFreePage(PageKind kind) {
+  Page *page;
+  if (!emptyPages[kind].empty()) {
+    page = emptyPages[kind].back();
+    emptyPages[kind].pop_back();
+    retainedBytes -= page->size;
+  } else {
+    if (releasedPages[kind].empty()) {
+      mapChunk(kind);
+    }
+    page = releasedPages[kind].back();
+    releasedPages[kind].pop_back();
+    releasedBytes -= page->size;
+  }
+  return page;
+}
+
+void *allocateCell(std::uint16_t sizeClass) {
+  std::vector<Page*> &partial = partialPages[sizeClass];
+  while (true) {
+    if (partial.empty()) {
+      Page *page = takeFreePage(pageKindOf(sizeClass));
+      page->format(sizeClass);
+      page->partial = true;
+      partial.push_back(page);
+    }
+    if (void *cell = partial.back()->allocate()) {
+      return cell;
+    }
+    partial.back()->partial = false;
+    partial.pop_back();
+  }
+}
+
+// Bump allocates from the region's current page of the size class. Pages
+// an earlier region dropped come first, then resident empty pages. Rather
+// than faulting in released memory, a heap page with free cells is taken
+// next, often one an earlier region adopted for a few escaped objects;
+// such a page can't be dropped whole (see Page::mixed).
+void *allocateRegionCell(std::uint16_t sizeClass) {
+  Page *&page = regionCurrent[sizeClass];
+  void *cell = page ? page->allocate() : nullptr;
+  if (cell && page->mixed) {
+    regionMixedCells.push_back(cell);
+  }
+  if (!cell) {
+    std::vector<Page*> &spare = regionSparePages[sizeClass];
+    std::vector<Page*> &partial = partialPages[sizeClass];
+    if (!spare.empty()) {
+      page = spare.back();
+      spare.pop_back();
+      retainedBytes -= page->size;
+      page->reset();
+    } else {
+      // allocateCell only drops a full page from the list when it next
+      // tries to allocate from it.
+      while (!partial.empty() &&
+             partial.back()->liveCount == partial.back()->cellCount) {
+        partial.back()->partial = false;
+        partial.pop_back();
+      }
+      if (emptyPages[pageKindOf(sizeClass)].empty() && !partial.empty()) {
+        page = partial.back();
+        partial.pop_back();
+        page->partial = false;
+        page->mixed = true;
+      } else {
+        page = takeFreePage(pageKindOf(sizeClass));
+        page->format(sizeClass);
+      }
+      if (!regionSpareSites.empty()) {
+        page->sites.swap(regionSpareSites.back());
+        regionSpareSites.pop_back();
+      }
+      // Stale entries are fine: every region allocation sets its own.
+      page->sites.resize(page->cellCount);
+    }
+    page->region = true;
+    regionPages.push_back(page);
+    cell = page->allocate();
+    if (page->mixed) {
+      regionMixedCells.push_back(cell);
+    }
+  }
+  return cell;
+}
+
+// Calls f on every object of the active region: the allocated cells of its
+// own pages, and the cells it took on mixed ones.
+void forEachRegionObject(const std::function<void(P)> &f) {
+  for (Page *page: regionPages) {
+    if (page->mixed) {
+      continue;
+    }
+    for (std::uint32_t w = 0; w < (page->bump + 63) / 64; w++) {
+      for (std::uint64_t bits = page->allocated[w]; bits; bits &= bits - 1) {
+        f(reinterpret_cast<P>(page->cell(w * 64 + __builtin_ctzll(bits))));
+      }
+    }
+  }
+  for (void *cell: regionMixedCells) {
+    f(static_cast<P>(cell));
+  }
+}
+
+// Hands a page with no live cells over to the scavenger.
+void retirePage(Page *page, std::chrono::steady_clock::time_point now) {
+  page->state = Page::State::EMPTY;
+  page->emptySince = now;
+  emptyPages[page->kind].push_back(page);
+  retainedBytes += page->size;
+}
+
+void freeCell(void *cell) {
+  Page *page = pageOf(cell);
+  page->free(cell);
+  if (page->region) {
+    return;
+  }
+  // Cells are freed here by runFinalizers well after the sweep, so this
+  // can be what empties a page.
+  if (page->liveCount == 0) {
+    if (page->partial) {
+      auto &partial = partialPages[page->sizeClass];
+      partial.erase(std::find(partial.begin(), partial.end(), page));
+      page->partial = false;
+    }
+    retirePage(page, std::chrono::steady_clock::now());
+  } else if (!page->partial) {
+    page->partial = true;
+    partialPages[page->sizeClass].push_back(page);
+  }
+}
+
+// Dead objects with nontrivial destructors (map nodes, vector buffers, ...)
+// aren't destroyed in the sweep. They are queued instead and torn down in
+// batches by runFinalizers, outside the collection pause. Large objects are
+// the exception (see sweepLargeObjects), whoever finds them dead.
+bool deferFinalization(P p) {
+  if (tracing) {
+    traceDeath(p);
+  }
+  if (p->info().trivial || p->sizeClass == 0) {
+    return false;
+  }
+  p->flags |= Object::FINALIZING;
+  finalizationQueue.push_back(p);
+  return true;
+}
+
+// Destroys up to 'budget' queued objects; returns whether any are left.
+bool runFinalizers(std::size_t budget) {
+  while (budget-- > 0 && !finalizationQueue.empty()) {
+    destroy(finalizationQueue.back());
+    finalizationQueue.pop_back();
+  }
+  return !finalizationQueue.empty();
+}
+
+// Calls the script-level finalizers of collected targets. Never called from
+// inside the allocator, since the callbacks can run arbitrary code.
+void runFinalizerCallbacks() {
+  while (!pendingFinalizers.empty()) {
+    Finalizer f = pendingFinalizers.back();
+    pendingFinalizers.pop_back();
+    StackPointer callback(f.callback), held(f.held);
+    callback->call(nil, {held});
+  }
+}
+
+// For embedders to call when the interpreter is idle: finishes as much
+// deferred finalization as fits before 'deadline', then scavenges.
+void collectIdle(std::chrono::steady_clock::time_point deadline) {
+  runFinalizerCallbacks();
+  while (runFinalizers(finalizerBatch) &&
+         std::chrono::steady_clock::now() < deadline) {}
+  scavenge(false);
+}
+
+// Frees unmarked cells and clears the mark bits. Pages left with no live
+// cells become empty (and eventually get scavenged); the partial page lists
+// are rebuilt from what remains. Frozen pages aren't looked at.
+void sweepPages() {
+  for (auto &partial: partialPages) {
+    partial.clear();
+  }
+  auto now = std::chrono::steady_clock::now();
+  for (auto &entry: chunks) {
+    for (Page &page: entry.second->pages) {
+      if (page.state != Page::State::IN_USE) {
+        continue;
+      }
+      for (std::uint32_t i = 0; i < page.bump; i++) {
+        if (!page.isAllocated(i)) {
+          continue;
+        }
+        P p = reinterpret_cast<P>(page.cell(i));
+        if (p->flags & Object::FINALIZING) {
+          continue;
+        }
+        // Region objects are only freed when their region ends.
+        if (!page.isMarked(i) && !(p->flags & Object::REGION)) {
+          if (!deferFinalization(p)) {
+            objectCount--;
+            page.free(p);
+          }
+        }
+      }
+      std::fill(std::begin(page.marked), std::end(page.marked), 0);
+      if (page.region) {
+        continue;
+      }
+      page.partial = false;
+      if (page.liveCount == 0) {
+        retirePage(&page, now);
+      } else if (page.liveCount < page.cellCount) {
+        page.partial = true;
+        partialPages[page.sizeClass].push_back(&page);
+      }
+    }
+  }
+}
+
+// Hands empty pages that have stayed empty for at least scavengeDecay (or
+// all of them, with 'all') back to the OS. The pages stay mapped, so their
+// addresses remain reserved for reuse.
+void scavenge(bool all) {
+  for (auto &spare: regionSparePages) {
+    for (Page *page: spare) {
+      std::vector<std::uint32_t>().swap(page->sites);
+      emptyPages[page->kind].push_back(page);
+    }
+    spare.clear();
+  }
+  regionSpareSites.clear();
+  auto cutoff = std::chrono::steady_clock::now() - scavengeDecay;
+  for (auto &empty: emptyPages) {
+    std::vector<Page*> kept;
+    for (Page *page: empty) {
+      if (!all && page->emptySince > cutoff) {
+        kept.push_back(page);
+        continue;
+      }
+#ifdef MADV_FREE
+      int advice = scavengeWithMadvFree ? MADV_FREE : MADV_DONTNEED;
+#else
+      int advice = MADV_DONTNEED;
+#endif
+      madvise(page->start, page->size, advice);
+#ifdef MADV_NOHUGEPAGE
+      // Otherwise khugepaged collapses the chunk's 2M range again, faulting
+      // the page right back in.
+      if (useHugePages) {
+        madvise(page->start, page->size, MADV_NOHUGEPAGE);
+      }
+#endif
+      page->state = Page::State::RELEASED;
+      releasedPages[page->kind].push_back(page);
+      retainedBytes -= page->size;
+      releasedBytes += page->size;
+    }
+    empty = std::move(kept);
+  }
+}
+
+// Request-scoped allocation. Between beginRegion and endRegion, small objects
+// are bump allocated from pages of the region's own, and allocation never
+// triggers a collection. endRegion works out which region objects escaped:
+// those rooted during the region (regionRoots), those stored into objects
+// outside the region or put into host containers (which remember them as
+// that happens), those seen by weak references or finalizers, and whatever
+// they reach. That is proportional to what the region did, not to the size
+// of the heap or its roots. Pages holding none of those are dropped whole,
+// to be reset for the next region; the others are adopted by the heap, with
+// their dead cells freed.
+void beginRegion() {
+  if (regionActive) {
+    throw "Regions don't nest";
+  }
+  regionActive = true;
+  std::fill(std::begin(regionCurrent), std::end(regionCurrent), nullptr);
+  if (tracing) {
+    traceRegion(true);
+  }
+}
+
+void endRegion() {
+  std::vector<P> stack;
+  auto escape = [&](P p) {
+    if (p && (p->flags & Object::REGION)) {
+      p->flags &= ~Object::REGION;
+      stack.push_back(p);
+    }
+  };
+  // A root slot holds the same object for as long as it is taken, so the
+  // slots taken for region objects are the only ones that can hold one now.
+  for (std::size_t slot: regionRoots) {
+    escape(roots[slot]);
+  }
+  for (P p: regionRemembered) {
+    escape(p);
+  }
+  if (conservativeStackScanning) {
+    std::vector<P> found;
+    scanNativeStack(found);
+    for (P p: found) {
+      escape(p);
+    }
+  }
+  // A page holding an escaped object is adopted: it stops being a region
+  // page here, and the pages still marked as region pages, and not mixed,
+  // get dropped.
+  while (!stack.empty()) {
+    P p = stack.back();
+    stack.pop_back();
+    Page *page = pageOf(p);
+    page->region = false;
+    if (std::uint32_t site = page->sites[page->indexOf(p)]) {
+      allocationSites[site].survived++;
+    }
+    if (refCounting && refcountOf(p) == 0) {
+      enterZeroCountTable(p);
+    }
+    p->traverse(escape);
+  }
+  regionActive = false;
+  for (std::uint32_t id: regionSites) {
+    AllocationSite &site = allocationSites[id];
+    site.inRegion = false;
+    if (site.released) {
+      releaseSite(id);
+      continue;
+    }
+    site.pretenure = site.regionAllocated >= pretenureMinSamples &&
+        site.survived >= site.regionAllocated * pretenureSurvival;
+    // Age the statistics so that a site whose behaviour changes is noticed.
+    if (site.regionAllocated > 64 * pretenureMinSamples) {
+      site.regionAllocated /= 2;
+      site.survived /= 2;
+    }
+  }
+  regionSites.clear();
+  if (tracing) {
+    for (Page *page: regionPages) {
+      for (std::uint32_t i = 0; i < page->bump; i++) {
+        P p = reinterpret_cast<P>(page->cell(i));
+        if (page->isAllocated(i) && (p->flags & Object::REGION)) {
+          traceDeath(p);
+        }
+      }
+    }
+    traceRegion(false);
+  }
+  // The counts of escaped objects are already right. What the dropped ones
+  // reference loses those references, and the log can't be left holding
+  // cells about to be freed.
+  if (refCounting) {
+    applyRefUpdates();
+    forEachRegionObject([](P p) {
+      if (p->flags & Object::REGION) {
+        p->traverse(decrementRef);
+      }
+    });
+  }
+  for (P p: regionFinalizable) {
+    if (p->flags & Object::REGION) {
+      p->info().destruct(p);
+    }
+  }
+  // Mixed pages may be full of long-lived objects, so rather than scanning
+  // them their region cells are freed from the list.
+  for (void *cell: regionMixedCells) {
+    P p = static_cast<P>(cell);
+    if (p->flags & Object::REGION) {
+      pageOf(p)->free(p);
+      objectCount--;
+    }
+  }
+  auto now = std::chrono::steady_clock::now();
+  for (Page *page: regionPages) {
+    if (page->region && !page->mixed) {
+      page->region = false;
+      objectCount -= page->liveCount;
+      page->state = Page::State::EMPTY;
+      page->emptySince = now;
+      regionSparePages[page->sizeClass].push_back(page);
+      retainedBytes += page->size;
+      continue;
+    }
+    page->region = false;
+    regionSpareSites.emplace_back();
+    regionSpareSites.back().swap(page->sites);
+    if (page->mixed) {
+      page->mixed = false;
+    } else {
+      // Only allocated cells are looked at, a bitmap word at a time.
+      for (std::uint32_t w = 0; w < (page->bump + 63) / 64; w++) {
+        for (std::uint64_t bits = page->allocated[w]; bits; bits &= bits - 1) {
+          P p = reinterpret_cast<P>(page->cell(w * 64 + __builtin_ctzll(bits)));
+          if (p->flags & Object::REGION) {
+            page->free(p);
+            objectCount--;
+          }
+        }
+      }
+    }
+    if (page->liveCount == 0) {
+      retirePage(page, now);
+    } else if (page->liveCount < page->cellCount) {
+      page->partial = true;
+      partialPages[page->sizeClass].push_back(page);
+    }
+  }
+  regionPages.clear();
+  regionMixedCells.clear();
+  regionFinalizable.clear();
+  regionRemembered.clear();
+  regionRoots.clear();
+  // Allocation never collects inside a region, so a workload that only
+  // allocates in regions collects what escaped them here, between requests.
+  if (objectCount > threshold) {
+    markAndSweep(true);
+  }
+}
+
+// For hosts that load their scripts and then fork workers: moves everything
+// in the heap into the permanent space. Frozen pages are left out of every
+// later sweep and frozen objects out of every later mark, so no collection,
+// in the parent or in a worker, writes to them again and they stay shared
+// copy-on-write. A frozen object that gets written to is traced as a root
+// from then on, like a builtin table. Frozen objects are never freed.
+void freezeHeap() {
+  if (regionActive) {
+    throw "Can't freeze the heap inside a region";
+  }
+  markAndSweep();
+  while (runFinalizers(finalizerBatch)) {}
+  for (auto &entry: chunks) {
+    for (Page &page: entry.second->pages) {
+      if (page.state != Page::State::IN_USE) {
+        continue;
+      }
+      for (std::uint32_t i = 0; i < page.bump; i++) {
+        if (page.isAllocated(i)) {
+          reinterpret_cast<P>(page.cell(i))->flags |= Object::PERMANENT;
+          objectCount--;
+        }
+      }
+      page.state = Page::State::FROZEN;
+      page.partial = false;
+    }
+  }
+  for (auto &partial: partialPages) {
+    partial.clear();
+  }
+  for (auto &entry: largeMappings) {
+    if (entry.second.object) {
+      static_cast<P>(entry.first)->flags |= Object::PERMANENT;
+      objectCount--;
+    }
+  }
+  if (refCounting) {
+    recountReferences();
+  }
+}
+
+int currentNumaNode() {
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return 0;
+  }
+  return static_cast<int>(node);
+}
+
+// Binds the whole heap, including memory already allocated, to 'node' and
+// keeps new chunks there. The kernel can refuse outright (for example on
+// machines without NUMA support), in which case placement is unchanged, or
+// for some mappings only (say, when the node runs out of memory part way):
+// those stay where they were, and the rest of the heap is bound.
+enum class Binding { REFUSED, PARTIAL, BOUND };
+Binding bindHeapToNode(int node) {
+  if (node < 0 || node >= static_cast<int>(sizeof(unsigned long) * CHAR_BIT)) {
+    throw "NUMA node out of range";
+  }
+  std::size_t bound = 0, failed = 0;
+  for (auto &entry: chunks) {
+    bindToNode(entry.first, CHUNK_SIZE, node) ? bound++ : failed++;
+  }
+  for (auto &entry: largeMappings) {
+    bindToNode(entry.first, entry.second.size, node) ? bound++ : failed++;
+  }
+  if (bound == 0 && failed > 0) {
+    return Binding::REFUSED;
+  }
+  heapNumaNode = node;
+  return failed ? Binding::PARTIAL : Binding::BOUND;
+}
+
+// The interpreter's heap belongs on the node of the thread that runs it.
+Binding bindHeapToCurrentNode() { return bindHeapToNode(currentNumaNode()); }
+
+// What the kernel says about the memory of this process's cgroup (v2).
+// Anything it doesn't say (no cgroup v2 mount, no limit, no PSI) is -1.
+struct MemoryStatus {
+  long current;       // memory.current, bytes
+  long max;           // memory.max, bytes
+  double someStall;   // PSI avg10: % of time some task waited on memory
+  double fullStall;   // PSI avg10: % of time all tasks did
+};
+
+// The directory of our cgroup: the cgroup2 mount point plus the path on the
+// "0::" line of /proc/self/cgroup.
+std::string cgroupDirectory() {
+  std::ifstream mounts("/proc/self/mounts");
+  std::string device, mountPoint, type, rest, mount;
+  while (mounts >> device >> mountPoint >> type && std::getline(mounts, rest)) {
+    if (type == "cgroup2") {
+      mount = mountPoint;
+      break;
+    }
+  }
+  std::ifstream cgroups("/proc/self/cgroup");
+  std::string line;
+  while (!mount.empty() && std::getline(cgroups, line)) {
+    if (line.compare(0, 3, "0::") == 0) {
+      return mount + line.substr(3);
+    }
+  }
+  return "";
+}
+
+long readCgroupValue(const std::string &path) {
+  std::ifstream file(path);
+  std::string value;
+  if (!(file >> value) || value == "max") {
+    return -1;
+  }
+  return std::strtol(value.c_str(), nullptr, 10);
+}
+
+// Reads avg10 off the "some" or "full" line of a PSI file.
+double readStall(const std::string &path, const std::string &kind) {
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string lineKind, avg10;
+    if (fields >> lineKind >> avg10 && lineKind == kind &&
+        avg10.compare(0, 6, "avg10=") == 0) {
+      return std::strtod(avg10.c_str() + 6, nullptr);
+    }
+  }
+  return -1;
+}
+
+MemoryStatus readMemoryStatus() {
+  static const std::string cgroup = cgroupDirectory();
+  std::string pressure = cgroup + "/memory.pressure";
+  if (cgroup.empty() || !std::ifstream(pressure)) {
+    pressure = "/proc/pressure/memory";
+  }
+  return MemoryStatus{
+    cgroup.empty() ? -1 : readCgroupValue(cgroup + "/memory.current"),
+    cgroup.empty() ? -1 : readCgroupValue(cgroup + "/memory.max"),
+    readStall(pressure, "some"),
+    readStall(pressure, "full"),
+  };
+}
+
+Pressure pressureOf(const MemoryStatus &status) {
+  double usage = status.current >= 0 && status.max > 0
+      ? static_cast<double>(status.current) / status.max : 0;
+  if (usage >= criticalUsage || status.fullStall >= criticalStall) {
+    return Pressure::CRITICAL;
+  }
+  if (usage >= moderateUsage || status.someStall >= moderateStall) {
+    return Pressure::MODERATE;
+  }
+  return Pressure::NONE;
+}
+
+// Samples the cgroup every pressureCheckInterval allocations (and no more
+// often than pressurePeriod), so that a container nearing its limit
+// collects and hands memory back before it gets OOM-killed. A forced
+// collection that didn't get the level back down would find just as
+// little the next sample, so while pressure stays CRITICAL it is only
+// repeated after criticalCooldown; meanwhile the tighter pacing applies.
+void checkMemoryPressure() {
+  allocationsSincePressureCheck = 0;
+  auto now = std::chrono::steady_clock::now();
+  if (now - lastPressureCheck < pressurePeriod) {
+    return;
+  }
+  lastPressureCheck = now;
+  Pressure previous = memoryPressure;
+  memoryPressure = pressureOf(readMemoryStatus());
+  if (memoryPressure == Pressure::CRITICAL && !regionActive &&
+      (previous != Pressure::CRITICAL ||
+       now - lastForcedCollection >= criticalCooldown)) {
+    lastForcedCollection = now;
+    markAndSweep(true);
+    while (runFinalizers(finalizerBatch)) {}
+    scavenge(true);
+  }
+}
+
+struct HeapStats {
+  std::size_t inUseBytes;    // pages holding live cells
+  std::size_t retainedBytes; // empty pages still resident
+  std::size_t releasedBytes; // empty pages returned to the OS
+  std::size_t largeObjectBytes;
+  std::size_t bufferBytes;   // smaller out-of-line storage
+};
+
+HeapStats heapStats() {
+  std::size_t reserved = chunks.size() * CHUNK_SIZE;
+  return HeapStats{
+    reserved - retainedBytes - releasedBytes,
+    retainedBytes,
+    releasedBytes,
+    largeObjectBytes,
+    bufferBytes,
+  };
+}
+
+// Pages in use, the large object space and the buffers outside it.
+std::size_t heapSize() {
+  HeapStats stats = heapStats();
+  return stats.inUseBytes + stats.largeObjectBytes + stats.bufferBytes;
+}
+
+// Called before every allocation of 'size' bytes. Crossing the soft limit
+// (or about to cross the hard one) collects everything that can be freed
+// first; the soft limit then rearms once the heap has grown by another
+// quarter. An allocation that would still cross the hard limit throws
+// "Out of memory" before anything is allocated, so the interpreter stays
+// consistent and the error can be caught like any other (see Try).
+void enforceHeapLimits(std::size_t size) {
+  std::size_t heap = heapSize();
+  bool overSoft = heapSoftLimit && heap + size > heapSoftLimit &&
+                  heap >= softLimitRearm;
+  bool overHard = heapHardLimit && heap + size > heapHardLimit;
+  if ((overSoft || overHard) && !regionActive) {
+    markAndSweep(true);
+    while (runFinalizers(finalizerBatch)) {}
+    heap = heapSize();
+    softLimitRearm = heap + heap / 4;
+  }
+  if (heapHardLimit && heap + size > heapHardLimit) {
+    throw "Out of memory";
+  }
+}
+
+// Large object space. Objects and buffers too big for any size class get a
+// page-aligned mapping of their own; they are never moved, and their pages
+// are unmapped, returning them to the OS, as soon as they are freed.
+void *allocateLarge(std::size_t size, bool object) {
+  size = (size + pageSize() - 1) / pageSize() * pageSize();
+  void *p = mapMemory(size);
+  placeMemory(p, size, size >= CHUNK_SIZE);
+  largeMappings[p] = LargeMapping{size, object, false, false, 0, 0};
+  largeObjectBytes += size;
+  return p;
+}
+
+void freeLarge(void *p) {
+  auto iter = largeMappings.find(p);
+  munmap(p, iter->second.size);
+  largeObjectBytes -= iter->second.size;
+  largeMappings.erase(iter);
+}
+
+// Large objects are few and big, and their pages should go back to the OS
+// right away, so they are destroyed in the sweep rather than deferred.
+void sweepLargeObjects() {
+  std::vector<P> dead;
+  for (auto &entry: largeMappings) {
+    if (!entry.second.object) {
+      continue;
+    }
+    P p = static_cast<P>(entry.first);
+    if (p->flags & Object::PERMANENT) {
+      continue;
+    }
+    if (!entry.second.marked) {
+      if (tracing) {
+        traceDeath(p);
+      }
+      dead.push_back(p);
+    } else {
+      entry.second.marked = false;
+    }
+  }
+  for (P p: dead) {
+    destroy(p);
+  }
+}
+
+// Small objects go into the active region unless their site is pretenured;
+// even then a sample of them does, so the site's survival rate stays known.
+bool allocateInRegion() {
+  if (!regionActive) {
+    return false;
+  }
+  const AllocationSite &site = allocationSites[currentSite];
+  return !currentSite || !site.pretenure ||
+         site.allocated % pretenureSampling == 0;
+}
+
+// Large objects get size class 0.
+void *allocateBytes(std::size_t size, std::uint16_t &sizeClass) {
+  if (size > LARGE_OBJECT_SIZE) {
+    sizeClass = 0;
+    return allocateLarge(size, true);
+  }
+  sizeClass = sizeClassOf(size);
+  return allocateInRegion() ? allocateRegionCell(sizeClass) : allocateCell(sizeClass);
+}
+
+void freeBytes(void *cell, std::uint16_t sizeClass) {
+  if (sizeClass == 0) {
+    freeLarge(cell);
+  } else {
+    freeCell(cell);
+  }
+}
+
+// Out-of-line backing stores, such as those of spilled Arrays and of the
+// containers in Tables (see BufferAllocator). Cells hold objects only, so
+// buffers up to LARGE_OBJECT_SIZE come from malloc and bigger ones from the
+// large object space.
+// Only the hard limit is checked here: the caller is mid-update and may be
+// holding unrooted objects, so this must not collect.
+void *allocateBuffer(std::size_t size) {
+  if (heapHardLimit && heapSize() + size > heapHardLimit) {
+    throw "Out of memory";
+  }
+  if (size > LARGE_OBJECT_SIZE) {
+    return allocateLarge(size, false);
+  }
+  void *p = ::operator new(size);
+  bufferBytes += size;
+  return p;
+}
+
+void freeBuffer(void *p, std::size_t size) {
+  if (size > LARGE_OBJECT_SIZE) {
+    freeLarge(p);
+  } else {
+    ::operator delete(p);
+    bufferBytes -= size;
+  }
+}
+
+// Grows a buffer from 'oldSize' to 'newSize' bytes, keeping its contents.
+// A buffer in the large object space is remapped rather than copied, so a
+// doubling Array doesn't map and unmap a whole new store at every step.
+void *growBuffer(void *p, std::size_t oldSize, std::size_t newSize) {
+  if (oldSize <= LARGE_OBJECT_SIZE) {
+    void *grown = allocateBuffer(newSize);
+    std::memcpy(grown, p, oldSize);
+    freeBuffer(p, oldSize);
+    return grown;
+  }
+  auto iter = largeMappings.find(p);
+  std::size_t mapped = iter->second.size;
+  newSize = (newSize + pageSize() - 1) / pageSize() * pageSize();
+  if (heapHardLimit && heapSize() + newSize - mapped > heapHardLimit) {
+    throw "Out of memory";
+  }
+  void *grown = mremap(p, mapped, newSize, MREMAP_MAYMOVE);
+  if (grown == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  LargeMapping mapping = iter->second;
+  largeMappings.erase(iter);
+  mapping.size = newSize;
+  largeMappings[grown] = mapping;
+  largeObjectBytes += newSize - mapped;
+  placeMemory(grown, newSize, newSize >= CHUNK_SIZE);
+  return grown;
+}
+
+// Calls f on every object in the heap. f mustn't allocate or free.
+template <class F>
+void forEachObject(F f) {
+  for (auto &entry: chunks) {
+    for (Page &page: entry.second->pages) {
+      if (page.state != Page::State::IN_USE) {
+        continue;
+      }
+      for (std::uint32_t i = 0; i < page.bump; i++) {
+        if (page.isAllocated(i)) {
+          f(reinterpret_cast<P>(page.cell(i)));
+        }
+      }
+    }
+  }
+  for (auto &entry: largeMappings) {
+    if (entry.second.object) {
+      f(static_cast<P>(entry.first));
+    }
+  }
+}
+
+// Deferred reference counting. Only references from heap objects are
+// counted; the roots aren't, so a zero count makes an object garbage only
+// once no root holds it either. Acyclic garbage is freed as soon as a batch
+// of updates is applied, without tracing the heap; markAndSweep is left as
+// the backup for whatever reference counting can't free. The counts live out
+// of line, in the object's Page or LargeMapping.
+
+std::uint32_t &refcountOf(P p) {
+  if (p->sizeClass == 0) {
+    return largeMappings.find(p)->second.refcount;
+  }
+  Page *page = pageOf(p);
+  return page->refcounts[page->indexOf(p)];
+}
+
+// Permanent objects aren't counted, and dead ones awaiting finalization no
+// longer are. Region objects are, and hold counted references like any
+// other, so the counts of the ones that escape are right when the region
+// ends; the references of the others are dropped then (see endRegion).
+bool counted(P p) {
+  return !(p->flags & (Object::PERMANENT | Object::FINALIZING));
+}
+
+// Anything a weak reference, ephemeron, finalizer or the intern table can
+// see is left to markAndSweep, which knows how to clear those. Region
+// objects are only ever freed by their region.
+bool reclaimable(P p) {
+  return counted(p) && !(p->flags & (Object::WEAKLY_HELD | Object::REGION));
+}
+
+// Only objects that can hold references can be part of a cycle.
+bool mayBeCyclic(P p) {
+  switch (p->type) {
+    case Type::ARRAY:
+    case Type::TABLE:
+    case Type::RECORD:
+    case Type::RECORD_COLUMNS:
+    case Type::TRACE_PROXY:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void enterZeroCountTable(P p) {
+  if (!(p->flags & (Object::IN_ZCT | Object::REGION))) {
+    p->flags |= Object::IN_ZCT;
+    zeroCountTable.push_back(p);
+  }
+}
+
+void incrementRef(P p) {
+  if (counted(p)) {
+    refcountOf(p)++;
+  }
+}
+
+void decrementRef(P p) {
+  if (!counted(p)) {
+    return;
+  }
+  if (--refcountOf(p) == 0) {
+    cycleCandidates.erase(p);
+    enterZeroCountTable(p);
+  } else if (mayBeCyclic(p) && !(p->flags & Object::REGION)) {
+    cycleCandidates.insert(p);
+  }
+}
+
+// Sets (or clears) the mark bits of whatever the roots hold, so that
+// isMarked tells whether an object is rooted.
+void markRoots(bool marked) {
+  auto paint = [marked](P p) {
+    if (p && !(p->flags & Object::PERMANENT)) {
+      setMarked(p, marked);
+    }
+  };
+  forEachRoot(paint);
+  for (auto list: {&finalizers, &pendingFinalizers}) {
+    for (Finalizer &f: *list) {
+      paint(f.callback);
+      paint(f.held);
+    }
+  }
+  // The stack will have changed by the time the bits are cleared, so what
+  // was found on it is remembered rather than scanned for again.
+  if (marked && conservativeStackScanning) {
+    scanNativeStack(nativeStackRoots);
+  }
+  for (P p: nativeStackRoots) {
+    paint(p);
+  }
+  if (!marked) {
+    nativeStackRoots.clear();
+  }
+}
+
+// Frees an unreferenced object, dropping the references it holds.
+void releaseObject(P p) {
+  p->traverse(decrementRef);
+  cycleCandidates.erase(p);
+  if (!deferFinalization(p)) {
+    destroy(p);
+  }
+}
+
+// Applies the logged updates, increments first so that no count dips below
+// its true value.
+void applyRefUpdates() {
+  for (P p: refIncrements) {
+    incrementRef(p);
+  }
+  refIncrements.clear();
+  std::vector<P> decrements;
+  decrements.swap(refDecrements);
+  for (P p: decrements) {
+    decrementRef(p);
+  }
+}
+
+// Applies the logged updates, then frees every unrooted object left with a
+// zero count, and everything that only they kept alive.
+void reconcileRefCounts() {
+  allocationsSinceReconcile = 0;
+  applyRefUpdates();
+  markRoots(true);
+  std::vector<P> rooted;
+  while (!zeroCountTable.empty()) {
+    P p = zeroCountTable.back();
+    zeroCountTable.pop_back();
+    p->flags &= ~Object::IN_ZCT;
+    if (!reclaimable(p) || refcountOf(p) != 0) {
+      continue;
+    }
+    if (isMarked(p)) {
+      rooted.push_back(p);
+    } else {
+      releaseObject(p);
+    }
+  }
+  for (P p: rooted) {
+    enterZeroCountTable(p);
+  }
+  markRoots(false);
+}
+
+// Trial deletion over the cycle candidates: subtract the references among
+// the objects reachable from them, and whatever is left with no references
+// from outside that subgraph (and no root) is a garbage cycle. Runs right
+// after reconcileRefCounts, when no log or zero count entry can point into
+// such a cycle.
+void collectCycles() {
+  std::unordered_map<P, long> trial;
+  std::vector<P> stack;
+  auto visit = [&](P q) -> long& {
+    auto entry = trial.emplace(q, refcountOf(q));
+    if (entry.second) {
+      stack.push_back(q);
+    }
+    return entry.first->second;
+  };
+  for (P p: cycleCandidates) {
+    visit(p);
+  }
+  cycleCandidates.clear();
+  while (!stack.empty()) {
+    P p = stack.back();
+    stack.pop_back();
+    p->traverse([&](P q) {
+      if (counted(q)) {
+        visit(q)--;
+      }
+    });
+  }
+  markRoots(true);
+  std::unordered_set<P> live;
+  for (auto &entry: trial) {
+    P p = entry.first;
+    if (entry.second > 0 || isMarked(p) || !reclaimable(p)) {
+      live.insert(p);
+      stack.push_back(p);
+    }
+  }
+  markRoots(false);
+  while (!stack.empty()) {
+    P p = stack.back();
+    stack.pop_back();
+    p->traverse([&](P q) {
+      if (trial.count(q) && live.insert(q).second) {
+        stack.push_back(q);
+      }
+    });
+  }
+  std::vector<P> garbage;
+  for (auto &entry: trial) {
+    if (!live.count(entry.first)) {
+      garbage.push_back(entry.first);
+    }
+  }
+  for (P p: garbage) {
+    p->traverse([&](P q) {
+      if (live.count(q)) {
+        decrementRef(q);
+      }
+    });
+  }
+  for (P p: garbage) {
+    if (!deferFinalization(p)) {
+      destroy(p);
+    }
+  }
+}
+
+// Recomputes every count from the heap itself: when reference counting is
+// switched on, and after markAndSweep has freed objects behind its back.
+void recountReferences() {
+  refIncrements.clear();
+  refDecrements.clear();
+  zeroCountTable.clear();
+  cycleCandidates.clear();
+  allocationsSinceReconcile = 0;
+  for (auto &entry: chunks) {
+    for (Page &page: entry.second->pages) {
+      if (page.state == Page::State::IN_USE) {
+        page.refcounts.assign(page.cellCount, 0);
+      }
+    }
+  }
+  for (auto &entry: largeMappings) {
+    entry.second.refcount = 0;
+  }
+  forEachObject([](P p) {
+    p->flags &= ~Object::IN_ZCT;
+    if (counted(p)) {
+      p->traverse(incrementRef);
+    }
+  });
+  for (P p: permanentMutables) {
+    p->traverse(incrementRef);
+  }
+  forEachObject([](P p) {
+    if (counted(p) && refcountOf(p) == 0) {
+      enterZeroCountTable(p);
+    }
+  });
+}
+
+// Marks 'p' as seen by a weak reference. The region can't clear weak
+// references to what it drops, so a region object that gets one escapes.
+void holdWeakly(P p) {
+  p->flags |= Object::WEAKLY_HELD;
+  if (p->flags & Object::REGION) {
+    regionRemembered.push_back(p);
+  }
+}
+
+void setRefCounting(bool enabled) {
+  refCounting = enabled;
+  if (enabled) {
+    recountReferences();
+  } else {
+    for (P p: zeroCountTable) {
+      p->flags &= ~Object::IN_ZCT;
+    }
+    zeroCountTable.clear();
+    refIncrements.clear();
+    refDecrements.clear();
+    cycleCandidates.clear();
+  }
+}
+
+// Checks the heap against the invariants the collector relies on, reporting
+// each violation to stderr; returns how many there were. 'when' says where
+// in the program this is, for the report. Run around every collection with
+// verifyCollections on.
+std::size_t verifyHeap(const char *when) {
+  std::size_t problems = 0;
+  auto fail = [&](const char *what, const void *p) {
+    std::cerr << "heap verification failed " << when << ": " << what
+              << " (" << p << ")" << std::endl;
+    problems++;
+  };
+  // Edges must lead to permanent objects or to live heap objects.
+  auto checkEdge = [&](const char *what, P q) {
+    if (q && !(q->flags & Object::PERMANENT) &&
+        objectAt(reinterpret_cast<std::uintptr_t>(q)) != q) {
+      fail(what, q);
+    }
+  };
+  std::unordered_map<P, long> references;
+  std::size_t finalizing = 0;
+  auto checkObject = [&](P p, bool large) {
+    constexpr std::uint8_t knownFlags = Object::PERMANENT |
+        Object::FINALIZING | Object::WEAKLY_HELD | Object::IN_ZCT |
+        Object::REGION | Object::REMEMBERED;
+    if (p->type > Type::TRACE_PROXY) {
+      fail("bad type", p);
+      return;
+    }
+    if ((p->sizeClass == 0) != large) {
+      fail("size class doesn't match its page", p);
+    }
+    if (p->flags & ~knownFlags) {
+      fail("unknown flags", p);
+    }
+    if ((p->flags & Object::IN_ZCT) && !refCounting) {
+      fail("on the zero count table without reference counting", p);
+    }
+    if ((p->flags & Object::REGION) && !regionActive) {
+      fail("region object outside a region", p);
+    }
+    if (isMarked(p) && !(p->flags & Object::PERMANENT)) {
+      fail("mark bit left set", p);
+    }
+    if (p->flags & Object::FINALIZING) {
+      finalizing++;
+      return;
+    }
+    p->traverse([&](P q) { checkEdge("dangling edge", q); });
+    if (counted(p)) {
+      p->traverse([&](P q) { references[q]++; });
+    }
+  };
+  for (auto &entry: chunks) {
+    for (Page &page: entry.second->pages) {
+      if (page.state != Page::State::IN_USE && page.state != Page::State::FROZEN) {
+        continue;
+      }
+      std::uint32_t live = 0;
+      for (std::uint32_t i = 0; i < page.bump; i++) {
+        if (!page.isAllocated(i)) {
+          continue;
+        }
+        live++;
+        P p = reinterpret_cast<P>(page.cell(i));
+        if (p->sizeClass != page.sizeClass) {
+          fail("size class doesn't match its page", p);
+        }
+        if (((p->flags & Object::PERMANENT) != 0) != (page.state == Page::State::FROZEN)) {
+          fail("permanent object on an in-use page, or the reverse", p);
+        }
+        if ((p->flags & Object::REGION) && !page.region) {
+          fail("region object on a heap page", p);
+        }
+        checkObject(p, false);
+      }
+      if (live != page.liveCount) {
+        fail("page live count is off", page.start);
+      }
+    }
+  }
+  for (auto &entry: largeMappings) {
+    if (entry.second.object) {
+      checkObject(static_cast<P>(entry.first), true);
+    }
+  }
+  if (finalizing != finalizationQueue.size()) {
+    fail("finalizing objects missing from the queue", nullptr);
+  }
+  forEachRoot([&](P p) { checkEdge("dangling root", p); });
+  for (Finalizer &f: finalizers) {
+    checkEdge("dangling finalizer target", f.target);
+  }
+  for (auto list: {&finalizers, &pendingFinalizers}) {
+    for (Finalizer &f: *list) {
+      checkEdge("dangling finalizer callback", f.callback);
+      checkEdge("dangling finalizer argument", f.held);
+    }
+  }
+  for (auto &entry: internTable) {
+    checkEdge("dangling interned symbol", entry.second);
+  }
+  for (P p: permanentMutables) {
+    p->traverse([&](P q) {
+      checkEdge("dangling edge from a permanent object", q);
+      references[q]++;
+    });
+  }
+  // A count plus its logged, not yet applied updates must match the
+  // references the heap actually holds.
+  if (refCounting) {
+    std::unordered_map<P, long> pending;
+    for (P p: refIncrements) {
+      pending[p]++;
+    }
+    for (P p: refDecrements) {
+      pending[p]--;
+    }
+    forEachObject([&](P p) {
+      if (counted(p) && refcountOf(p) + pending[p] != references[p]) {
+        fail("reference count doesn't match the heap", p);
+      }
+    });
+  }
+  return problems;
+}
+
+// 'size' is sizeof(T) plus whatever T keeps inline after itself.
+template <class T, class ...Args>
+T *allocate(std::size_t size, Args &&...args) {
+  std::uint16_t sizeClass;
+  void *cell = allocateBytes(size, sizeClass);
+  T *t;
+  try {
+    t = new (cell) T(std::forward<Args>(args)...);
+  } catch (...) {
+    freeBytes(cell, sizeClass);
+    throw;
+  }
+  t->sizeClass = sizeClass;
+  return t;
+}
+
+void destroy(P p) {
+  std::uint16_t sizeClass = p->sizeClass;
+  objectCount--;
+  p->info().destruct(p);
+  freeBytes(p, sizeClass);
+}
+
+template <class T, class ...Args>
+T *make(Args &&...args) {
+  return makeSized<T>(sizeof(T), std::forward<Args>(args)...);
+}
+
+template <class T, class ...Args>
+T *makeSized(std::size_t size, Args &&...args) {
+  enforceHeapLimits(size);
+  if (++allocationsSincePressureCheck >= pressureCheckInterval) {
+    checkMemoryPressure();
+  }
+  if (gcStressInterval > 0) {
+    if (++allocationsSinceStress >= gcStressInterval) {
+      allocationsSinceStress = 0;
+      markAndSweep(true);
+    }
+  } else if (objectCount > threshold && !regionActive) {
+    markAndSweep(true);
+  }
+  if (refCounting && ++allocationsSinceReconcile >= reconcileInterval) {
+    reconcileRefCounts();
+    if (cycleCandidates.size() >= cycleCandidateLimit) {
+      collectCycles();
+    }
+  }
+
+  // Pay off a little of the deferred finalization with every allocation.
+  runFinalizers(finalizerBatch);
+  if (currentSite) {
+    allocationSites[currentSite].allocated++;
+  }
+  T *t = allocate<T>(size, std::forward<Args>(args)...);
+  objectCount++;
+  if (regionActive) {
+    Page *page = t->sizeClass != 0 ? pageOf(t) : nullptr;
+    if (page && page->region) {
+      t->flags |= Object::REGION;
+      if (!t->info().trivial) {
+        regionFinalizable.push_back(t);
+      }
+      if (t->flags & Object::WEAKLY_HELD) {
+        regionRemembered.push_back(t);
+      }
+      page->sites[page->indexOf(t)] = currentSite;
+      if (currentSite) {
+        AllocationSite &site = allocationSites[currentSite];
+        site.regionAllocated++;
+        if (!site.inRegion) {
+          site.inRegion = true;
+          regionSites.push_back(currentSite);
+        }
+      }
+    } else {
+      // Large and pretenured objects are allocated outside the region, so
+      // any region objects they start out holding have escaped.
+      t->traverse([](P q) {
+        if (q->flags & Object::REGION) {
+          regionRemembered.push_back(q);
+        }
+      });
+    }
+  }
+  if (tracing) {
+    traceAllocation(t, size);
+  }
+  if (refCounting) {
+    // A new object is referenced from nowhere in the heap yet.
+    if (counted(t)) {
+      refcountOf(t) = 0;
+      enterZeroCountTable(t);
+    }
+    t->traverse([](P q) { refIncrements.push_back(q); });
+  }
+  return t;
 }
+
+// Permanent objects come straight from operator new: they are never freed,
+// so they needn't take up cells in the heap's pages.
 template <class T, class ...Args>
-T *make(Args &&...args) {
+T *makePermanent(Args &&...args) {
+  T *t = new (::operator new(sizeof(T))) T(std::forward<Args>(args)...);
+  t->flags |= Object::PERMANENT;
+  // What the constructor stored didn't go through the write barrier.
+  t->traverse([t](P q) { rememberMutation(t, q); });
+  return t;
+}
+
+
+void addFinalizer(P target, P callback, P held) {
+  holdWeakly(target);
+  // The callback and its argument escape any region they were made in.
+  for (P p: {callback, held}) {
+    if (p && (p->flags & Object::REGION)) {
+      regionRemembered.push_back(p);
+    }
+  }
+  finalizers.push_back(Finalizer{target, callback, held});
+}
+
+// Allocation traces: a compact binary log of what the mutator did to the
+// heap, for replaying workloads against allocator and collector changes
+// without their scripts. A trace is the magic string followed by records,
+// each an opcode byte and LEB128 operands. Objects are numbered in order of
+// allocation and referred to by how far back they were allocated (so that
+// young objects take a byte), with 0 standing for none, or for anything
+// outside the heap.
+//
+// StackPointers and heap stores are logged as they happen. The other roots
+// (root sets, the native stack when it is scanned, finalizer registrations)
+// change without the collector seeing it, so they are logged as a snapshot
+// at every collection and every traceRootsInterval allocations; an object
+// held only through those is never held raw across an allocation, so it is
+// in the next snapshot.
+enum class TraceOp: std::uint8_t {
+  ALLOCATE = 1,  // type, size in bytes, allocation site (0 for none)
+  DIE,           // object; freed or queued for finalization
+  ROOT,          // object; a StackPointer took it
+  UNROOT,        // object; a StackPointer let go of it
+  STORE,         // holder, old value, new value
+  BEGIN_REGION,
+  END_REGION,
+  ROOTS,         // count, objects; everything else that is a root right now
+  PUT,           // ephemeron table, key, value
+  COLLECT,       // the host asked for a collection
+};
+long traceRootsInterval = 4096;
+const char TRACE_MAGIC[8] = {'g', 'c', 't', 'r', 'a', 'c', 'e', '1'};
+
+struct TraceRecorder {
+  std::ofstream out;
+  std::string buffer;
+  pid_t pid;  // a forked worker doesn't write to its parent's trace
+  std::uint64_t lastId = 0;
+  std::uint64_t lastSite = 0;
+  long allocationsSinceRoots = 0;
+
+  void put(std::uint64_t n) {
+    do {
+      char byte = n & 0x7f;
+      n >>= 7;
+      buffer.push_back(n ? byte | 0x80 : byte);
+    } while (n);
+  }
+  void op(TraceOp o) {
+    if (buffer.size() >= 64 * 1024) {
+      flush();
+    }
+    buffer.push_back(static_cast<char>(o));
+  }
+  void flush() {
+    if (getpid() == pid) {
+      out.write(buffer.data(), buffer.size());
+    }
+    buffer.clear();
+  }
+  // Object numbers live out of line, like reference counts, in the Page
+  // or LargeMapping; 0 is an object the trace hasn't seen.
+  static std::uint64_t &idSlot(P p) {
+    if (p->sizeClass == 0) {
+      return largeMappings.find(p)->second.traceId;
+    }
+    Page *page = pageOf(p);
+    if (page->traceIds.empty()) {
+      page->traceIds.assign(page->cellCount, 0);
+    }
+    return page->traceIds[page->indexOf(p)];
+  }
+  // Objects allocated before recording started are logged as allocated
+  // when first seen.
+  std::uint64_t idOf(P p) {
+    if (!p || (p->flags & Object::PERMANENT)) {
+      return 0;
+    }
+    if (std::uint64_t id = idSlot(p)) {
+      return id;
+    }
+    std::size_t size = p->sizeClass
+        ? cellSizeOf(p->sizeClass) : largeMappings.find(p)->second.size;
+    allocated(p, size, 0);
+    return lastId;
+  }
+  void putObject(P p) {
+    std::uint64_t id = idOf(p);
+    put(id ? lastId - id + 1 : 0);
+  }
+  void allocated(P p, std::size_t size, std::uint32_t site) {
+    std::uint64_t siteId = 0;
+    if (site) {
+      std::uint64_t &traceId = allocationSites[site].traceId;
+      siteId = traceId ? traceId : (traceId = ++lastSite);
+    }
+    op(TraceOp::ALLOCATE);
+    put(static_cast<std::uint64_t>(p->type));
+    put(size);
+    put(siteId);
+    idSlot(p) = ++lastId;
+  }
+};
+std::unique_ptr<TraceRecorder> traceRecorder;
+
+// Starts recording to 'path', returning false if it can't be written.
+bool startTrace(const std::string &path) {
+  std::unique_ptr<TraceRecorder> recorder(new TraceRecorder());
+  recorder->out.open(path, std::ios::binary | std::ios::trunc);
+  if (!recorder->out) {
+    return false;
+  }
+  recorder->out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  recorder->pid = getpid();
+  for (auto &entry: chunks) {
+    for (Page &page: entry.second->pages) {
+      page.traceIds.clear();
+    }
+  }
+  for (auto &entry: largeMappings) {
+    entry.second.traceId = 0;
+  }
+  for (AllocationSite &site: allocationSites) {
+    site.traceId = 0;
+  }
+  traceRecorder = std::move(recorder);
+  tracing = true;
+  return true;
+}
+
+void stopTrace() {
+  if (traceRecorder) {
+    traceRecorder->flush();
+    traceRecorder.reset();
+  }
+  tracing = false;
+}
+
+// 'allocating' is an object whose allocation record is yet to come.
+void traceRoots(P allocating) {
+  std::vector<P> found;
+  for (const RootSet *set: rootSets) {
+    set->traceRoots([&found](P p) { found.push_back(p); });
+  }
+  if (conservativeStackScanning) {
+    scanNativeStack(found);
+  }
+  for (auto list: {&finalizers, &pendingFinalizers}) {
+    for (Finalizer &f: *list) {
+      found.push_back(f.callback);
+      found.push_back(f.held);
+    }
+  }
+  found.erase(std::remove_if(found.begin(), found.end(), [allocating](P p) {
+    return p == allocating || traceRecorder->idOf(p) == 0;
+  }), found.end());
+  traceRecorder->allocationsSinceRoots = 0;
+  traceRecorder->op(TraceOp::ROOTS);
+  traceRecorder->put(found.size());
+  for (P p: found) {
+    traceRecorder->putObject(p);
+  }
+}
 
-#if DEBUG_GC
-  // NOTE: For debugging, do a full markAndSweep every time we allocate an
-  // object
+void traceAllocation(P p, std::size_t size) {
+  // The new object can't be in the snapshot, so it comes first: in the
+  // replay, objects allocated since the last snapshot are held anyway.
+  if (++traceRecorder->allocationsSinceRoots >= traceRootsInterval) {
+    traceRoots(p);
+  }
+  traceRecorder->allocated(p, size, currentSite);
+  // What the constructor stored didn't go through the write barrier.
+  p->traverse([p](P q) { traceEdge(p, nullptr, q); });
+}
+
+void traceDeath(P p) {
+  if (p->sizeClass && pageOf(p)->traceIds.empty()) {
+    return;  // nothing on this page has been seen
+  }
+  std::uint64_t &id = TraceRecorder::idSlot(p);
+  if (id) {
+    traceRecorder->op(TraceOp::DIE);
+    traceRecorder->put(traceRecorder->lastId - id + 1);
+    id = 0;
+  }
+}
+
+void traceRoot(P p, bool rooted) {
+  if (!(p->flags & Object::PERMANENT)) {
+    traceRecorder->idOf(p);
+    traceRecorder->op(rooted ? TraceOp::ROOT : TraceOp::UNROOT);
+    traceRecorder->putObject(p);
+  }
+}
+
+void traceEdge(P holder, P from, P to) {
+  // Look everything up first, so that any late allocation records come
+  // before this one.
+  traceRecorder->idOf(holder);
+  traceRecorder->idOf(from);
+  traceRecorder->idOf(to);
+  traceRecorder->op(TraceOp::STORE);
+  traceRecorder->putObject(holder);
+  traceRecorder->putObject(from);
+  traceRecorder->putObject(to);
+}
+
+void tracePut(P table, P key, P value) {
+  traceRecorder->idOf(table);
+  traceRecorder->idOf(key);
+  traceRecorder->idOf(value);
+  traceRecorder->op(TraceOp::PUT);
+  traceRecorder->putObject(table);
+  traceRecorder->putObject(key);
+  traceRecorder->putObject(value);
+}
+
+void traceRegion(bool begin) {
+  traceRecorder->op(begin ? TraceOp::BEGIN_REGION : TraceOp::END_REGION);
+}
+
+void traceCollection() {
+  traceRecorder->op(TraceOp::COLLECT);
+}
+
+// Drives the allocator and collector from a trace, with whatever settings
+// this process runs with. Every object is replayed as a TraceProxy of its
+// recorded size holding its recorded references, or, if it was one, as an
+// ephemeron table, and lives as long as the replayed roots and stores keep
+// it reachable. Destructors aren't replayed: proxies are freed in the
+// sweep. The collections the host asked for are replayed; the rest are up to
+// this process. Objects the snapshots can't vouch for yet are held until the
+// next one: those allocated since the last snapshot, and those that have
+// since lost a reference or a root (and so may have moved into a root set). DIE records only serve as a check: a
+// record that refers to an object the replay has already freed, or that
+// the trace said was dead, is counted and skipped.
+// Prints what the replay did; returns false if the trace is unreadable or
+// anything was counted.
+bool replayTrace(const std::string &path) {
+  if (tracing) {
+    std::cerr << "can't record a replay" << std::endl;
+    return false;
+  }
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(TRACE_MAGIC)];
+  if (!in.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+    std::cerr << path << ": not a trace" << std::endl;
+    return false;
+  }
+  // Read a block at a time, so the trace doesn't add its own size to what
+  // the replay is measured to use.
+  std::vector<char> block(64 * 1024);
+  std::size_t pos = 0, end = 0;
+  auto more = [&]() -> bool {
+    if (pos == end) {
+      in.read(block.data(), block.size());
+      pos = 0;
+      end = static_cast<std::size_t>(in.gcount());
+    }
+    return pos < end;
+  };
+  bool truncated = false;
+  auto get = [&]() -> std::uint64_t {
+    std::uint64_t n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (!more()) {
+        truncated = true;
+        return 0;
+      }
+      auto byte = static_cast<unsigned char>(block[pos++]);
+      n |= std::uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    return n;
+  };
+  // By trace number: the replayed object, which the replay may have freed
+  // since (the number in its cell's traceId slot tells), and whether the
+  // trace has said it died.
+  std::vector<P> objects(1, nullptr);
+  std::vector<bool> died(1, false);
+  std::vector<std::uint32_t> heldIn(1, 0);  // snapshot epoch it's held for
+  std::uint32_t epoch = 1;
+  gc::map<std::uint64_t, P> rooted;  // by StackPointers
+  std::unordered_map<std::uint64_t, long> rootCounts;
+  gc::vector<P> snapshot;  // the last ROOTS record
+  gc::vector<P> held;      // until the next one
+  std::map<std::uint64_t, std::uint32_t> sites;  // trace's -> this process's
+  // Holds what permanent objects hold.
+  StackPointer outside(make<TraceProxy>(sizeof(TraceProxy)));
+  long records = 0, stores = 0, freedEarly = 0, usedAfterDeath = 0;
+  std::size_t peakHeap = 0;
+  auto idOf = [&](std::uint64_t back) -> std::uint64_t {
+    return back == 0 || back > objects.size() - 1 ? 0 : objects.size() - back;
+  };
+  auto resolve = [&](std::uint64_t id) -> P {
+    if (id == 0) {
+      return nullptr;
+    }
+    if (died[id]) {
+      usedAfterDeath++;
+      return nullptr;
+    }
+    P p = objects[id];
+    if (objectAt(reinterpret_cast<std::uintptr_t>(p)) != p ||
+        TraceRecorder::idSlot(p) != id) {
+      freedEarly++;
+      return nullptr;
+    }
+    return p;
+  };
+  auto hold = [&](std::uint64_t id, P p) {
+    if (p && heldIn[id] != epoch) {
+      heldIn[id] = epoch;
+      held.push_back(p);
+    }
+  };
+  auto start = std::chrono::steady_clock::now();
+  while (!truncated && more()) {
+    records++;
+    switch (static_cast<TraceOp>(block[pos++])) {
+      case TraceOp::ALLOCATE: {
+        auto type = static_cast<Type>(get());
+        std::size_t size = get();
+        std::uint64_t site = get();
+        if (site && !sites.count(site)) {
+          sites[site] = newSite();
+        }
+        currentSite = site ? sites[site] : 0;
+        P p;
+        if (type == Type::EPHEMERON_TABLE) {
+          p = makeSized<EphemeronTable>(std::max(size, sizeof(EphemeronTable)));
+        } else {
+          size = std::max(size, sizeof(TraceProxy));
+          p = makeSized<TraceProxy>(size, size);
+        }
+        currentSite = 0;
+        std::uint64_t id = objects.size();
+        TraceRecorder::idSlot(p) = id;
+        objects.push_back(p);
+        died.push_back(false);
+        heldIn.push_back(0);
+        hold(id, p);
+        peakHeap = std::max(peakHeap, heapSize());
+        break;
+      }
+      case TraceOp::DIE: {
+        std::uint64_t id = idOf(get());
+        if (id) {
+          died[id] = true;
+        }
+        break;
+      }
+      case TraceOp::ROOT: {
+        std::uint64_t id = idOf(get());
+        if (P p = resolve(id)) {
+          if (rootCounts[id]++ == 0) {
+            rooted.set(id, p);
+          }
+        }
+        break;
+      }
+      case TraceOp::UNROOT: {
+        std::uint64_t id = idOf(get());
+        auto iter = rootCounts.find(id);
+        if (iter != rootCounts.end() && --iter->second == 0) {
+          hold(id, rooted.at(id));
+          rooted.erase(id);
+          rootCounts.erase(iter);
+        }
+        break;
+      }
+      case TraceOp::STORE: {
+        std::uint64_t holderId = idOf(get()), fromId = idOf(get()), toId = idOf(get());
+        P holder = holderId ? resolve(holderId) : outside.get();
+        P from = resolve(fromId), to = resolve(toId);
+        auto proxy = holder ? cast<TraceProxy>(holder) : nullptr;
+        if (!proxy || (toId && !to)) {
+          break;
+        }
+        stores++;
+        if (from && proxy->replace(from, to)) {
+          hold(fromId, from);
+          writeBarrier(proxy, from, to);
+        } else if (to) {
+          proxy->replace(nullptr, to);
+          writeBarrier(proxy, nullptr, to);
+        }
+        break;
+      }
+      case TraceOp::PUT: {
+        std::uint64_t tableId = idOf(get()), keyId = idOf(get()), valueId = idOf(get());
+        P table = resolve(tableId), key = resolve(keyId), value = resolve(valueId);
+        auto ephemerons = table ? cast<EphemeronTable>(table) : nullptr;
+        if (ephemerons && key && (value || !valueId)) {
+          stores++;
+          ephemerons->put(key, value ? value : nil);
+        }
+        break;
+      }
+      case TraceOp::BEGIN_REGION:
+        beginRegion();
+        break;
+      case TraceOp::END_REGION:
+        endRegion();
+        break;
+      case TraceOp::COLLECT:
+        markAndSweep();
+        break;
+      case TraceOp::ROOTS: {
+        std::vector<P> found;
+        for (std::uint64_t n = get(); n > 0 && !truncated; n--) {
+          if (P p = resolve(idOf(get()))) {
+            found.push_back(p);
+          }
+        }
+        snapshot.assign(found.begin(), found.end());
+        held.clear();
+        epoch++;
+        pruneProxyReferences();
+        break;
+      }
+      default:
+        truncated = true;
+        break;
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  for (auto &entry: sites) {
+    releaseSite(entry.second);
+  }
+  if (truncated) {
+    std::cerr << path << ": trace truncated or corrupt after " << records
+              << " records" << std::endl;
+  }
   markAndSweep();
-#else
-  if (allManagedObjects.size() > threshold) {
-    markAndSweep();
+  long left = 0;
+  for (std::uint64_t id = 1; id < objects.size(); id++) {
+    P p = objects[id];
+    left += objectAt(reinterpret_cast<std::uintptr_t>(p)) == p &&
+        TraceRecorder::idSlot(p) == id;
   }
-#endif
+  std::cout << "replayed " << records << " records: " << objects.size() - 1
+            << " allocations, " << stores << " stores in "
+            << std::chrono::duration<double, std::milli>(elapsed).count()
+            << " ms; peak heap " << peakHeap << " bytes, " << left
+            << " objects left alive" << std::endl;
+  std::cout << "inconsistencies: " << freedEarly
+            << " references to objects the replay freed, " << usedAfterDeath
+            << " to objects the trace said were dead" << std::endl;
+  return !truncated && freedEarly == 0 && usedAfterDeath == 0;
+}
 
-  T *t = new T(std::forward<Args>(args)...);
-  allManagedObjects.push_back(t);
-  return t;
+// benchmarks
+template <class F>
+void bench(const char *name, long iterations, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++) {
+    f(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+  std::cout << name << ": " << ns / iterations << " ns/op" << std::endl;
+}
+
+void printHeapStats(const char *when) {
+  HeapStats stats = heapStats();
+  std::cout << "heap " << when << ": " << stats.inUseBytes << " in use, "
+            << stats.retainedBytes << " retained, " << stats.releasedBytes
+            << " released" << std::endl;
+}
+
+// Private_Dirty of this process in kB: the memory it doesn't share with its
+// parent (or anyone else).
+long privateDirtyKb() {
+  std::ifstream smaps("/proc/self/smaps_rollup");
+  std::string field;
+  while (smaps >> field) {
+    long kb;
+    if (field == "Private_Dirty:" && smaps >> kb) {
+      return kb;
+    }
+  }
+  return -1;
 }
 
+void runBenchmarks() {
+  // A chain of nested scopes, each declaring its own handful of names, with
+  // assignments landing at every depth of the chain.
+  const int depth = 8, namesPerScope = 16;
+  std::vector<StackPointer> scopes;
+  Table *scope = nullptr;
+  std::vector<Symbol> names;
+  for (int d = 0; d < depth; d++) {
+    scopes.push_back(make<Table>(scope));
+    scope = static_cast<Table*>(scopes.back().get());
+    for (int i = 0; i < namesPerScope; i++) {
+      names.push_back(intern("v" + std::to_string(d) + "_" + std::to_string(i)));
+      scope->declare(names.back(), nil);
+    }
+  }
+  StackPointer value(mkn(1));
+  bench("Table::set (local)", 1000000, [&](long i) {
+    scope->set(names[names.size() - 1 - i % namesPerScope], value);
+  });
+  bench("Table::set (scope chain)", 1000000, [&](long i) {
+    scope->set(names[i % names.size()], value);
+  });
+  bench("Table::declare", 1000000, [&](long i) {
+    Symbol s = names[i % names.size()];
+    if (!scope->remove(s)) {
+      scope->declare(s, value);
+    }
+  });
+  StackPointer array(mkarr(std::vector<P>(1000, value)));
+  bench("Array element scan (inline)", 100000, [&](long) {
+    auto a = static_cast<Array*>(array.get());
+    for (std::size_t i = 0; i < a->size(); i++) {
+      if (!a->at(i)) {
+        throw "null element";
+      }
+    }
+  });
+  {
+    // Symbols are collectable, so they need rooting like any other object.
+    StackPointer xroot(intern("x")), yroot(intern("y")), tag(intern("tag"));
+    Symbol x = cast<SymbolObject>(xroot);
+    StackPointer pointType(mkrecordtype({
+      {x, RecordType::Kind::NUMBER},
+      {cast<SymbolObject>(yroot), RecordType::Kind::NUMBER},
+      {cast<SymbolObject>(tag), RecordType::Kind::VALUE},
+    }));
+    auto pt = static_cast<RecordType*>(pointType.get());
+    StackPointer point(mkrecord(pt));
+    StackPointer columns(mkcolumns(pt));
+    std::cout << "Record with 3 fields: " << cellSizeOf(point->sizeClass)
+              << " bytes" << std::endl;
+    bench("Record field set", 1000000, [&](long) {
+      point->set(x, value);
+    });
+    std::size_t xslot = pt->slotOf(x);
+    bench("Record field store (slot)", 1000000, [&](long) {
+      static_cast<Record*>(point.get())->store(xslot, value);
+    });
+    auto cols = static_cast<RecordColumns*>(columns.get());
+    for (int i = 0; i < 1000000; i++) {
+      cols->push(static_cast<Record*>(point.get()));
+    }
+    bench("RecordColumns column scan", 100, [&](long) {
+      double total = 0;
+      for (const Slot &slot: cols->columns[xslot]) {
+        total += slot.number;
+      }
+      if (total != cols->size()) {
+        throw "bad column sum";
+      }
+    });
+  }
+  // The columns' stores are in the large object space.
+  markAndSweep();
+  while (runFinalizers(finalizerBatch)) {}
+  std::size_t retainedLargeBytes = largeObjectBytes;
+  bench("medium Array allocate and free", 1000, [&](long) {
+    {
+      StackPointer medium(mkarr(std::vector<P>(4096, value)));
+    }
+    markAndSweep();
+    if (largeObjectBytes != retainedLargeBytes) {
+      throw "medium object in the large object space";
+    }
+  });
+  bench("Array grown to 1M elements by push", 20, [&](long) {
+    StackPointer grown(mkarr({}));
+    auto array = static_cast<Array*>(grown.get());
+    for (int i = 0; i < 1 << 20; i++) {
+      array->push(value);
+    }
+  });
+  markAndSweep();
+  bench("large Array allocate and free", 20, [&](long) {
+    {
+      StackPointer big(mkarr(std::vector<P>(1 << 20, value)));
+    }
+    markAndSweep();
+    if (largeObjectBytes != retainedLargeBytes) {
+      throw "large object space not released";
+    }
+  });
+  {
+    StackPointer spike(mkarr({}));
+    for (int i = 0; i < 5000; i++) {
+      static_cast<Array*>(spike.get())->push(make<Table>(nullptr));
+    }
+    printHeapStats("after spike");
+  }
+  markAndSweep();
+  while (runFinalizers(finalizerBatch)) {}
+  printHeapStats("after collection");
+  scavenge(true);
+  printHeapStats("after scavenge");
+  {
+    // Marking a heap of many small, linked objects: sensitive to TLB reach
+    // and to which node the pages live on.
+    StackPointer list(mkarr({}));
+    for (int i = 0; i < 10000; i++) {
+      auto a = static_cast<Array*>(list.get());
+      a->push(make<Table>(a->size() ? cast<Table>(a->at(a->size() - 1)) : nullptr));
+    }
+    bench("markAndSweep (10k objects)", 50, [&](long) { markAndSweep(); });
+    if (bindHeapToCurrentNode() != Binding::REFUSED) {
+      bench("markAndSweep (10k objects, node bound)", 50, [&](long) {
+        markAndSweep();
+      });
+    }
+    // The same heap with a mark stack far too small for it: everything
+    // must still survive, by way of page rescans.
+    std::size_t before = objectCount;
+    markStackCapacity = 16;
+    bench("markAndSweep (10k objects, 16-entry mark stack)", 50, [&](long) {
+      markAndSweep();
+    });
+    markStackCapacity = 4096;
+    std::cout << "objects after overflowing marks: " << objectCount
+              << " (" << before << " before)" << std::endl;
+    std::cout << "heap verifier: " << verifyHeap("in benchmarks")
+              << " problems" << std::endl;
+    bench("verifyHeap (10k objects)", 10, [&](long) { verifyHeap("in benchmarks"); });
+  }
+  {
+    StackPointer tables(mkarr({}));
+    for (int i = 0; i < 5000; i++) {
+      StackPointer t(make<Table>(nullptr));
+      for (std::size_t j = 0; j < 20; j++) {
+        t->declare(names[j], value);
+      }
+      static_cast<Array*>(tables.get())->push(t);
+    }
+    tables = nil;
+    bench("markAndSweep pause (5k dead Tables)", 1, [&](long) {
+      markAndSweep();
+    });
+    bench("deferred finalization (5k dead Tables)", 1, [&](long) {
+      while (runFinalizers(finalizerBatch)) {}
+    });
+  }
+  setRefCounting(true);
+  {
+    StackPointer tables(mkarr({}));
+    for (int i = 0; i < 5000; i++) {
+      static_cast<Array*>(tables.get())->push(make<Table>(nullptr));
+    }
+    long before = objectCount;
+    tables = nil;
+    bench("reference count reconcile (5k dead Tables)", 1, [&](long) {
+      reconcileRefCounts();
+    });
+    while (runFinalizers(finalizerBatch)) {}
+    std::cout << "freed by reference counting: " << before - objectCount
+              << " objects" << std::endl;
+  }
+  {
+    StackPointer pairs(mkarr({}));
+    for (int i = 0; i < 1000; i++) {
+      StackPointer a(make<Table>(nullptr));
+      StackPointer b(make<Table>(nullptr));
+      a->declare(names[0], b);
+      b->declare(names[0], a);
+      static_cast<Array*>(pairs.get())->push(a);
+    }
+    long before = objectCount;
+    pairs = nil;
+    reconcileRefCounts();
+    bench("trial deletion (1k dead cycles)", 1, [&](long) { collectCycles(); });
+    while (runFinalizers(finalizerBatch)) {}
+    std::cout << "freed by cycle collection: " << before - objectCount
+              << " objects" << std::endl;
+  }
+  setRefCounting(false);
+  {
+    // A request builds up scratch objects and hands one result back to the
+    // host through a table that outlives it.
+    StackPointer results(make<Table>(nullptr));
+    results->declare(names[0], nil);
+    auto request = [&](long i) {
+      StackPointer scratch(mkarr({}));
+      for (int j = 0; j < 100; j++) {
+        static_cast<Array*>(scratch.get())->push(make<Table>(nullptr));
+      }
+      results->set(names[0], mkn(i));
+    };
+    bench("request (heap)", 2000, request);
+    bench("request (region)", 2000, [&](long i) {
+      beginRegion();
+      request(i);
+      endRegion();
+    });
+    {
+      // Ending a region doesn't look at what host containers hold.
+      gc::vector<Table*> callbacks;
+      for (int i = 0; i < 200000; i++) {
+        callbacks.push_back(make<Table>(nullptr));
+      }
+      bench("request (region, 200k host callbacks)", 2000, [&](long i) {
+        beginRegion();
+        request(i);
+        endRegion();
+      });
+    }
+    markAndSweep();
+    while (runFinalizers(finalizerBatch)) {}
+    std::cout << "result after regions: " << results->get(names[0])->debugstr()
+              << std::endl;
+  }
+  {
+    // Two allocation sites in a request: one builds tables the host keeps,
+    // the other scratch tables that die with the request.
+    struct Build: Expression {
+      P evaluate(P env) override {
+        StackPointer t(make<Table>(nullptr));
+        if (env != nil) {
+          static_cast<Array*>(env)->push(t);
+        }
+        return t;
+      }
+    };
+    auto keeper = std::make_shared<Build>();
+    auto scratch = std::make_shared<Build>();
+    StackPointer kept(mkarr({}));
+    bench("request (region, pretenuring)", 10, [&](long) {
+      beginRegion();
+      for (int j = 0; j < 50; j++) {
+        keeper->eval(kept);
+        scratch->eval(nil);
+      }
+      endRegion();
+    });
+    const AllocationSite &k = allocationSites[keeper->site];
+    const AllocationSite &s = allocationSites[scratch->site];
+    std::cout << "pretenured: keeper " << k.pretenure << " (" << k.survived
+              << "/" << k.regionAllocated << " survived), scratch "
+              << s.pretenure << " (" << s.survived << "/" << s.regionAllocated
+              << " survived)" << std::endl;
+  }
+  bench("intern fresh symbol", 2000, [&](long i) {
+    intern("generated" + std::to_string(i));
+  });
+  markAndSweep();
+  std::cout << "intern table after collection: " << internTable.size()
+            << " symbols" << std::endl;
+  Symbol lt = intern("lt");
+  auto &methods = value->methods();
+  bench("builtin method lookup", 10000000, [&](long) {
+    if (!methods.find(lt)) {
+      throw "missing builtin";
+    }
+  });
+  {
+    // A permanent table only becomes a root of every collection once it is
+    // given a heap object.
+    std::size_t before = permanentMutables.size();
+    Table *library = makePermanent<Table>(nullptr);
+    library->declare(lt, nil);
+    std::cout << "permanent tables traced: " << permanentMutables.size() - before
+              << " holding builtins, ";
+    StackPointer string(mks("heap"));
+    library->set(lt, string);
+    std::cout << permanentMutables.size() - before << " holding a heap value"
+              << std::endl;
+  }
+  bench("metatable method lookup", 10000000, [&](long i) {
+    scope->get(names[names.size() - 1 - i % namesPerScope]);
+  });
+  bench("StackPointer copy", 10000000, [&](long) {
+    StackPointer copy(value);
+  });
+  bench("StackPointer move", 10000000, [&](long) {
+    StackPointer moved(std::move(value));
+    value = std::move(moved);
+  });
+  {
+    // Loading a script with many repeated literals costs one root and one
+    // constant per distinct value.
+    std::size_t rootsBefore = roots.size() - freeRoots.size();
+    auto unit = std::make_shared<ConstantPool>();
+    std::vector<E> literals;
+    for (int i = 0; i < 5000; i++) {
+      literals.push_back(mklit(unit, i % 2 ? mkn(i % 50) : mks(std::to_string(i % 50))));
+    }
+    std::cout << literals.size() << " literals: "
+              << roots.size() - freeRoots.size() - rootsBefore << " roots, "
+              << unit->size() << " constants" << std::endl;
+  }
+  {
+    // A host keeping many script callbacks: a root slot each when held by
+    // StackPointers, one root for a whole gc::vector or gc::map.
+    markAndSweep();
+    while (runFinalizers(finalizerBatch)) {}
+    long objectsBefore = objectCount;
+    std::size_t rootsBefore = roots.size() - freeRoots.size();
+    gc::vector<Table*> callbacks;
+    gc::map<std::string, Table*> named;
+    for (int i = 0; i < 2000; i++) {
+      callbacks.push_back(make<Table>(nullptr));
+      Table *t = make<Table>(nullptr);
+      named.set(std::to_string(i), t);
+    }
+    markAndSweep();
+    std::cout << "host containers: " << objectCount - objectsBefore
+              << " objects kept, " << roots.size() - freeRoots.size() - rootsBefore
+              << " root slots" << std::endl;
+    bench("markAndSweep (4k objects in gc containers)", 50, [&](long) {
+      markAndSweep();
+    });
+    std::vector<StackPointer> handles(callbacks.begin(), callbacks.end());
+    for (auto &entry: named) {
+      handles.emplace_back(entry.second);
+    }
+    callbacks.clear();
+    named.clear();
+    bench("markAndSweep (4k objects in StackPointers)", 50, [&](long) {
+      markAndSweep();
+    });
+  }
+  {
+    // Host code holding nothing but raw pointers, kept alive by the stack
+    // scan through a collection on every allocation.
+    conservativeStackScanning = true;
+    gcStressInterval = 1;
+    Table *head = nullptr;
+    for (int i = 0; i < 1000; i++) {
+      Table *t = make<Table>(head);
+      t->declare(names[0], mkn(i));
+      head = t;
+    }
+    int length = 0;
+    for (Table *t = head; t; t = t->proto) {
+      length++;
+    }
+    std::cout << "raw list after collections: " << length << " tables" << std::endl;
+    gcStressInterval = 0;
+    bench("markAndSweep (stack scanned)", 50, [&](long) { markAndSweep(); });
+    conservativeStackScanning = false;
+  }
+  MemoryStatus memory = readMemoryStatus();
+  std::cout << "cgroup memory: " << memory.current << " of " << memory.max
+            << ", stall some " << memory.someStall << "% full "
+            << memory.fullStall << "%" << std::endl;
+  bench("memory pressure sample", 1000, [&](long) { readMemoryStatus(); });
+  {
+    // Pressure that stays CRITICAL: only the first sample forces a collection.
+    double usage = criticalUsage;
+    auto period = pressurePeriod;
+    criticalUsage = 0;
+    pressurePeriod = std::chrono::milliseconds(0);
+    int forced = 0;
+    for (int i = 0; i < 10; i++) {
+      auto before = lastForcedCollection;
+      checkMemoryPressure();
+      forced += lastForcedCollection != before;
+    }
+    criticalUsage = usage;
+    pressurePeriod = period;
+    memoryPressure = pressureOf(readMemoryStatus());
+    std::cout << "forced collections in 10 critical samples: " << forced
+              << std::endl;
+  }
+  if (!tracing) {
+    // What recording a trace costs the mutator. The pages these land on
+    // were just scavenged, so fault them back in first.
+    for (int i = 0; i < 100000; i++) {
+      make<Table>(nullptr);
+    }
+    bench("make<Table> (not traced)", 100000, [&](long) { make<Table>(nullptr); });
+    if (startTrace("/dev/null")) {
+      bench("make<Table> (traced)", 100000, [&](long) { make<Table>(nullptr); });
+      stopTrace();
+    }
+  }
+  {
+    // A preforking host: how much of the parent's heap does a collection in
+    // a worker copy? Freezing the heap can't be undone, so this goes last.
+    StackPointer shared(mkarr({}));
+    for (int i = 0; i < 5000; i++) {
+      static_cast<Array*>(shared.get())->push(make<Table>(nullptr));
+    }
+    auto collectInWorker = [](const char *name) {
+      std::cout.flush();
+      pid_t pid = fork();
+      if (pid == 0) {
+        long before = privateDirtyKb();
+        markAndSweep();
+        std::cout << name << ": " << privateDirtyKb() - before
+                  << " kB copied" << std::endl;
+        _exit(0);
+      }
+      waitpid(pid, nullptr, 0);
+    };
+    collectInWorker("markAndSweep after fork");
+    freezeHeap();
+    collectInWorker("markAndSweep after fork (frozen heap)");
+  }
+}
 
 }  // namespace gclang
 
-int main() {
+int main(int argc, char **argv) {
   using namespace gclang;
+  // --gc-stress=N collects every N allocations; --verify-heap checks the
+  // heap around each collection; both check root releases (see checkRoots);
+  // --ref-counting turns on reference counting;
+  // --trace=FILE records the run for 'replay FILE' to play back.
+  bool benchmarks = false;
+  const char *replay = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (std::strncmp(argv[i], "--trace=", 8) == 0) {
+      if (!startTrace(argv[i] + 8)) {
+        std::cerr << "can't write " << argv[i] + 8 << std::endl;
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "replay") == 0 && i + 1 < argc) {
+      replay = argv[++i];
+    } else if (std::strncmp(argv[i], "--gc-stress=", 12) == 0) {
+      gcStressInterval = std::atol(argv[i] + 12);
+      checkRoots = true;
+    } else if (std::strcmp(argv[i], "--verify-heap") == 0) {
+      verifyCollections = true;
+      checkRoots = true;
+    } else if (std::strcmp(argv[i], "--ref-counting") == 0) {
+      setRefCounting(true);
+    } else if (std::strcmp(argv[i], "bench") == 0) {
+      benchmarks = true;
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--gc-stress=N] [--verify-heap]"
+                << " [--ref-counting] [--trace=FILE] [bench | replay FILE]"
+                << std::endl;
+      return 2;
+    }
+  }
+  if (replay) {
+    bool replayed = replayTrace(replay);
+    stopTrace();
+    return replayed ? 0 : 1;
+  }
+  if (benchmarks) {
+    runBenchmarks();
+    stopTrace();
+    return 0;
+  }
+  // Behaviour checks below exit non-zero when they fail, so test.sh sees it.
+  int failures = 0;
+  auto check = [&failures](bool ok, const char *what) {
+    if (!ok) {
+      std::cerr << "check failed: " << what << std::endl;
+      failures++;
+    }
+  };
+  auto unit = std::make_shared<ConstantPool>();
   auto b = mkblock({
-    mklit(mkn(5)),
+    mklit(unit, mkn(5)),
   });
   auto r = b->eval(nullptr);
   std::cout << r->equals(mkn(5)) << std::endl;
   std::cout << r->equals(mks("Hello world!")) << std::endl;
-  std::cout << mks("Hello world!")->equals(mks("Hello world!")) << std::endl;
-  auto c = mkif(mklit(mkn(0)), mklit(nil), mklit(mkn(5)))->eval(nullptr);
+  StackPointer hello(mks("Hello world!"));
+  std::cout << hello->equals(mks("Hello world!")) << std::endl;
+  auto c = mkif(mklit(unit, mkn(0)), mklit(unit, nil), mklit(unit, mkn(5)))
+      ->eval(nullptr);
   std::cout << c->debugstr() << std::endl;
   {
-    auto flit = mklit(mkfunc([](P, const std::vector<P>&) -> P {
+    StackPointer two(mkn(2));
+    StackPointer sum(two->callm(intern("add"), {mkn(3)}));
+    std::cout << sum->debugstr() << std::endl;
+    StackPointer array(mkarr({two, sum}));
+    static_cast<Array*>(array.get())->push(mks("three"));
+    std::cout << array->equals(array) << std::endl;
+    StackPointer x(intern("x")), label(intern("label"));
+    StackPointer pointType(mkrecordtype({
+      {cast<SymbolObject>(x), RecordType::Kind::NUMBER},
+      {cast<SymbolObject>(label), RecordType::Kind::VALUE},
+    }));
+    StackPointer point(mkrecord(static_cast<RecordType*>(pointType.get())));
+    point->set(intern("x"), sum);
+    point->set(intern("label"), array);
+    std::cout << point->get(intern("x"))->debugstr() << std::endl;
+    {
+      auto record = static_cast<Record*>(point.get());
+      std::size_t labelSlot = record->recordType->slotOf(cast<SymbolObject>(label));
+      record->store(labelSlot, mks("by slot"));
+      check(record->load(labelSlot)->equals(point->get(cast<SymbolObject>(label))),
+            "Record load by slot matches get by name");
+    }
+    bool duplicateRejected = false;
+    try {
+      mkrecordtype({
+        {cast<SymbolObject>(x), RecordType::Kind::NUMBER},
+        {cast<SymbolObject>(x), RecordType::Kind::VALUE},
+      });
+    } catch (const std::string&) {
+      duplicateRejected = true;
+    }
+    check(duplicateRejected, "record type with a duplicate field rejected");
+    StackPointer columns(mkcolumns(static_cast<RecordType*>(pointType.get())));
+    bool rowRejected = false;
+    try {
+      static_cast<RecordColumns*>(columns.get())->load(0, 0);
+    } catch (const char*) {
+      rowRejected = true;
+    }
+    check(rowRejected, "RecordColumns row out of range rejected");
+    StackPointer cache(mkephemerons());
+    StackPointer weak(mkweak(point));
+    {
+      StackPointer key(mks("key"));
+      cache->callm(builtin(sym::put), {key, point});
+      StackPointer cached(cache->callm(builtin(sym::get), {key}));
+      std::cout << cached->debugstr() << std::endl;
+      check(cached == point, "ephemeron lookup of a live key");
+    }
+    static std::string finalized;
+    StackPointer finalizer(mkfunc([](P, const std::vector<StackPointer> &args) -> P {
+      finalized = static_cast<String*>(args[0].get())->str();
+      std::cout << "finalized " << finalized << std::endl;
+      return nil;
+    }));
+    addFinalizer(point, finalizer, mks("point"));
+    point = nil;
+    markAndSweep();
+    runFinalizerCallbacks();
+    std::size_t entries = static_cast<EphemeronTable*>(cache.get())->entries.size();
+    P target = weak->callm(builtin(sym::deref), {});
+    std::cout << entries << " " << target->debugstr() << std::endl;
+    check(entries == 0, "ephemeron entry dropped with its key");
+    check(target == nil, "weak reference cleared with its target");
+    check(finalized == "point", "finalizer called with its argument");
+  }
+  {
+    auto flit = mklit(mkfunc([](P, const std::vector<StackPointer>&) -> P {
       return nil;
     }));
   }
+  {
+    // A script compiled, run and dropped within one request: its allocation
+    // site has to last until the region ends.
+    struct Build: Expression {
+      P evaluate(P) override { return make<Table>(nullptr); }
+    };
+    auto script = std::make_shared<Build>();
+    std::size_t freeBefore = freeSites.size();
+    beginRegion();
+    {
+      StackPointer result(script->eval(nil));
+      script.reset();
+    }
+    std::size_t freedInside = freeSites.size() - freeBefore;
+    std::cout << "sites freed inside the region: " << freedInside << std::endl;
+    endRegion();
+    std::size_t freedAfter = freeSites.size() - freeBefore;
+    std::cout << "sites freed after it: " << freedAfter << std::endl;
+    check(freedInside == 0, "site kept while its region objects live");
+    check(freedAfter == 1, "site freed once its region ends");
+  }
+  {
+    // A region table given to a heap table and then taken back still
+    // escapes, so a collection inside the region mustn't free what it holds.
+    StackPointer key(intern("key"));
+    Symbol k = cast<SymbolObject>(key);
+    StackPointer holder(make<Table>(nullptr));
+    holder->declare(k, nil);
+    StackPointer child(make<Table>(nullptr));
+    beginRegion();
+    {
+      StackPointer local(make<Table>(nullptr));
+      local->declare(k, child);
+      holder->set(k, local);
+      holder->set(k, nil);
+    }
+    child = nil;
+    markAndSweep();
+    endRegion();
+    check(verifyHeap("after a collection inside a region") == 0,
+          "region objects promoted with live references");
+  }
+  {
+    // A region object put into a host container escapes its region.
+    gc::vector<P> kept;
+    beginRegion();
+    kept.push_back(mks("kept"));
+    endRegion();
+    markAndSweep();
+    P p = kept[0];
+    check(objectAt(reinterpret_cast<std::uintptr_t>(p)) == p &&
+          static_cast<String*>(p)->str() == "kept",
+          "region object in a gc::vector kept past its region");
+  }
+  {
+    // A runaway script under a hard limit, caught by a Try.
+    struct Hog: Expression {
+      P evaluate(P env) override {
+        for (;;) {
+          static_cast<Array*>(env)->push(make<Table>(nullptr));
+        }
+      }
+    };
+    StackPointer hog(mkarr({}));
+    auto script = mktry(std::make_shared<Hog>(), mklit(mks("caught")));
+    heapHardLimit = heapSize() + 256 * 1024;
+    StackPointer result(script->eval(hog));
+    std::cout << static_cast<String*>(result.get())->str() << " out of memory after "
+              << static_cast<Array*>(hog.get())->size() << " Tables" << std::endl;
+    check(static_cast<String*>(result.get())->str() == "caught",
+          "runaway allocation stopped at the hard limit");
+    // Buffers count too, however small.
+    hog = nil;
+    markAndSweep();
+    while (runFinalizers(finalizerBatch)) {}
+    heapHardLimit = heapSize() + 256 * 1024;
+    bool stopped = false;
+    {
+      StackPointer arrays(mkarr({}));
+      try {
+        for (int i = 0; i < 2000; i++) {
+          StackPointer array(mkarr({}));
+          static_cast<Array*>(arrays.get())->push(array);
+          for (int j = 0; j < 8000; j++) {
+            static_cast<Array*>(array.get())->push(nil);
+          }
+        }
+      } catch (const char*) {
+        stopped = heapSize() <= heapHardLimit;
+      }
+    }
+    heapHardLimit = 0;
+    check(stopped, "Array buffers stopped at the hard limit");
+    StackPointer table(make<Table>(nullptr)), entry(intern("entry"));
+    std::size_t before = heapSize();
+    table->declare(cast<SymbolObject>(entry), nil);
+    check(heapSize() > before, "Table entries counted in the heap size");
+  }
+  {
+    // A constant the pool failed to take isn't left in its index.
+    auto pool = std::make_shared<ConstantPool>();
+    StackPointer number(mkn(100000)), foo(mks("foo"));
+    while (pool->size() < 4) {
+      pool->add(mkn(pool->size()));
+    }
+    heapHardLimit = heapSize();
+    bool failed = false;
+    try {
+      pool->add(number);
+    } catch (const char*) {
+      failed = true;
+    }
+    heapHardLimit = 0;
+    pool->add(foo);
+    check(failed && pool->add(number) == number.get(),
+          "constant pool unchanged by a failed add");
+  }
+  {
+    // A large object freed by its count mustn't be queued for finalization:
+    // the next sweep of the large object space would free it again.
+    bool wasCounting = refCounting;
+    setRefCounting(true);
+    {
+      StackPointer outer(mkarr({}));
+      for (int i = 0; i < 200; i++) {
+        static_cast<Array*>(outer.get())->push(make<Table>(nullptr));
+      }
+      static_cast<Array*>(outer.get())->push(mkarr(std::vector<P>(10000, nil)));
+    }
+    reconcileRefCounts();
+    markAndSweep();
+    while (runFinalizers(finalizerBatch)) {}
+    check(verifyHeap("after counting a large object out") == 0,
+          "large object freed by its count destroyed once");
+    setRefCounting(wasCounting);
+  }
+  stopTrace();
+  return failures ? 1 : 0;
 }
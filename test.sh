@@ -1 +1,2 @@
 g++ --std=c++11 -Wall -Werror -Wpedantic -Wextra -Iinclude src/*.cc foo.cc && ./a.out
+g++ --std=c++11 -Wall -Werror -Wpedantic -Wextra gclang.cc -o gclang && ./gclang && ./gclang --gc-stress=1 --verify-heap && ./gclang --ref-counting --verify-heap && ./gclang --trace=gclang.trace > /dev/null && ./gclang --verify-heap replay gclang.trace && rm gclang.trace